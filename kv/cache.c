@@ -1,195 +1,656 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "cache.h"
 #include "cache_list.h"
+#include "trace.h"
 #include "log.h"
 
-#define HASH_SLOT 1021
+// prefetch reads at most this many pages at once and reads through holes
+// of up to CACHE_PREFETCH_GAP pages instead of seeking
+#define CACHE_PREFETCH_RUN 256
+#define CACHE_PREFETCH_GAP 8
+#define CACHE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// without a file pages live in an arena of chunks of 2^CACHE_ARENA_SHIFT pages
+#define CACHE_ARENA_SHIFT 10
+#define CACHE_ARENA_PAGE(__C__, __N__) ((kv_page*)((__C__)->chunks[(__N__) >> CACHE_ARENA_SHIFT] + \
+                                        (size_t)(__C__)->page_size * ((__N__) & ((1 << CACHE_ARENA_SHIFT) - 1))))
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+// internal nodes are kept in frames of their own beyond cache_pages, allocated in
+// chunks of 2^CACHE_NODE_CHUNK_SHIFT as the tree grows and never evicted
+#define CACHE_NODE_CHUNK_SHIFT 6
 
 typedef struct __kv_page_cache_item{
     struct cache_list list;
-    struct cache_list hash_list;
     uint8_t           dirty;
+    uint8_t           node;
+    uint16_t          pins;
+    uint32_t          frame;
     kv_page           *page;
 }kv_page_cache_item;
 
-typedef struct __kv_page_cache_item_hash {
-	struct cache_list slots[HASH_SLOT];
-}kv_page_cache_item_hash;
+// open addressing page number -> frame index table with linear probing,
+// page 0 is never cached so it marks an empty slot
+typedef struct __kv_page_table_entry{
+    uint32_t page;
+    uint32_t frame;
+}kv_page_table_entry;
+
+typedef struct __kv_page_table{
+    kv_page_table_entry *slots;
+    uint32_t mask;
+    uint32_t shift;
+}kv_page_table;
 
 typedef struct __kv_page_cache{
     uint32_t pages;
     uint32_t cache_pages;
+    uint32_t page_size;
     size_t   offset;
     FILE     *f;
     uint8_t  *buf;
+    size_t   buf_size;
+    bool     buf_mapped;
     kv_page_cache_item *items;
+    kv_page_table      table;
     struct cache_list free_list;
-    struct cache_list       read_list;
-    kv_page_cache_item_hash read_hash;
-    struct cache_list       dirty_list;
-    kv_page_cache_item_hash dirty_hash;
+    struct cache_list read_list;
+    struct cache_list dirty_list;
     uint32_t dirty;
+    kv_cache_stats stats;
+    cache_write_hook write_hook;
+    void*            write_ptr;
+    uint8_t**        chunks;
+    uint32_t         chunk_num;
+    // clean nodes are in node_list, dirty ones in dirty_list like any page
+    kv_page_cache_item** node_chunks;
+    uint32_t             node_chunk_num;
+    uint32_t             node_pages;
+    struct cache_list    node_free;
+    struct cache_list    node_list;
 }kv_page_cache;
 
-void cache_init_hash(kv_page_cache_item_hash* h){
-    for(int i=0; i<HASH_SLOT; ++i){
-        list_init(&h->slots[i]);
+uint64_t cache_now_usec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t cache_table_home(kv_page_table* t, uint32_t page){
+    return (uint32_t)(page * 2654435769u) >> t->shift;
+}
+
+// size the table to at most half full for frames pages, nothing to do if it already is
+void cache_table_resize(kv_page_table* t, uint32_t frames){
+    uint32_t bits = 6;
+    for(; (1u << bits) < frames * 2; ++bits){
     }
+
+    if(t->slots != NULL && t->mask == (1u << bits) - 1){
+        return;
+    }
+
+    kv_page_table old = *t;
+    t->slots = (kv_page_table_entry*)calloc(1u << bits, sizeof(kv_page_table_entry));
+    t->mask  = (1u << bits) - 1;
+    t->shift = 32 - bits;
+    if(old.slots == NULL){
+        return;
+    }
+
+    for(uint32_t i=0; i<=old.mask; ++i){
+        if(old.slots[i].page == NULL_PAGE){
+            continue;
+        }
+        uint32_t n = cache_table_home(t, old.slots[i].page);
+        for(; t->slots[n].page != NULL_PAGE; n = (n + 1) & t->mask){
+        }
+        t->slots[n] = old.slots[i];
+    }
+    free(old.slots);
 }
 
-kv_page_cache_item* cache_find_item(kv_page_cache_item_hash* h, uint32_t page){
-    struct cache_list* head = &h->slots[page % HASH_SLOT];
-    for (struct cache_list* l = list_first(head); l != list_sentinel(head); l = list_next(l)) {
-        kv_page_cache_item *item = list_data(l, kv_page_cache_item, hash_list);
-        if(item->page->page == page){
-            return item;
+// frames from cache_pages on belong to the node pool
+kv_page_cache_item* cache_item_at(kv_page_cache* c, uint32_t frame){
+    if(frame < c->cache_pages){
+        return c->items + frame;
+    }
+    frame -= c->cache_pages;
+    return c->node_chunks[frame >> CACHE_NODE_CHUNK_SHIFT] + (frame & ((1 << CACHE_NODE_CHUNK_SHIFT) - 1));
+}
+
+kv_page_cache_item* cache_find_item(kv_page_cache* c, uint32_t page){
+    kv_page_table* t = &c->table;
+    for(uint32_t n = cache_table_home(t, page); ; n = (n + 1) & t->mask){
+        if(t->slots[n].page == page){
+            return cache_item_at(c, t->slots[n].frame);
+        }
+        if(t->slots[n].page == NULL_PAGE){
+            return NULL;
         }
     }
-    return NULL;
 }
 
-void add_item_to_hash(kv_page_cache_item_hash* h, struct cache_list *l, kv_page_cache_item* item){
-    list_insert_head(l, &item->list);
+void cache_table_insert(kv_page_table* t, uint32_t page, uint32_t frame){
+    uint32_t n = cache_table_home(t, page);
+    for(; t->slots[n].page != NULL_PAGE; n = (n + 1) & t->mask){
+    }
+    t->slots[n].page  = page;
+    t->slots[n].frame = frame;
+}
+
+// backward shift deletion keeps every probe chain free of holes
+void cache_table_remove(kv_page_table* t, uint32_t page){
+    uint32_t n = cache_table_home(t, page);
+    for(; t->slots[n].page != page; n = (n + 1) & t->mask){
+        if(t->slots[n].page == NULL_PAGE){
+            return;
+        }
+    }
+
+    for(uint32_t next = (n + 1) & t->mask; t->slots[next].page != NULL_PAGE; next = (next + 1) & t->mask){
+        uint32_t home = cache_table_home(t, t->slots[next].page);
+        // move the entry back unless its home lies cyclically in (n, next]
+        if(((next - home) & t->mask) >= ((next - n) & t->mask)){
+            t->slots[n] = t->slots[next];
+            n = next;
+        }
+    }
+    t->slots[n].page = NULL_PAGE;
+}
 
-    struct cache_list* head = &h->slots[item->page->page % HASH_SLOT];
-    list_insert_head(head, &item->hash_list);
+void cache_add_item(kv_page_cache* c, struct cache_list *l, kv_page_cache_item* item){
+    list_insert_head(l, &item->list);
+    cache_table_insert(&c->table, item->page->page, item->frame);
 }
 
-void del_item_from_hash(kv_page_cache_item* item){
+void cache_del_item(kv_page_cache* c, kv_page_cache_item* item){
     list_remove(&item->list);
-    list_remove(&item->hash_list);
+    cache_table_remove(&c->table, item->page->page);
 }
 
-kv_page_cache_item* remove_tail_from_read_list(kv_page_cache* cache){
-    if(list_empty(&cache->read_list)){
-        FATAL("cache read list is empty")
+// the page buffer is mapped lazily so that large caches cost neither startup
+// time nor resident memory until pages are used, and backed by huge pages
+// when possible to cut TLB misses on random page access
+void cache_alloc_buf(kv_page_cache* c, size_t size){
+#ifndef _WIN32
+    c->buf_mapped = true;
+#ifdef MAP_HUGETLB
+    if(size >= CACHE_HUGE_PAGE_SIZE){
+        c->buf_size = (size + CACHE_HUGE_PAGE_SIZE - 1) / CACHE_HUGE_PAGE_SIZE * CACHE_HUGE_PAGE_SIZE;
+        c->buf = (uint8_t*)mmap(NULL, c->buf_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(c->buf != MAP_FAILED){
+            return;
+        }
     }
+#endif
+    c->buf_size = size;
+    c->buf = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(c->buf == MAP_FAILED){
+        FATAL("map cache buffer of %zu bytes failed with errno: %d", size, errno);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(c->buf, size, MADV_HUGEPAGE);
+#endif
+#else
+    c->buf_mapped = false;
+    c->buf_size   = size;
+    c->buf = (uint8_t*)calloc(1, size);
+    if(c->buf == NULL){
+        FATAL("alloc cache buffer of %zu bytes failed", size);
+    }
+#endif
+}
 
-    struct cache_list* l = list_last(&cache->read_list);
-    kv_page_cache_item *item = list_data(l, kv_page_cache_item, list);
-    del_item_from_hash(item);
-    return item;
+void cache_free_buf(kv_page_cache* c){
+#ifndef _WIN32
+    if(c->buf_mapped){
+        munmap(c->buf, c->buf_size);
+        return;
+    }
+#endif
+    free(c->buf);
+}
+
+// grow the arena to hold pages, or free it all when pages is 0
+void cache_arena_resize(kv_page_cache* c, uint32_t pages){
+    uint32_t num = (pages + (1 << CACHE_ARENA_SHIFT) - 1) >> CACHE_ARENA_SHIFT;
+    if(num == 0){
+        for(uint32_t i=0; i<c->chunk_num; ++i){
+            free(c->chunks[i]);
+        }
+        c->chunk_num = 0;
+        return;
+    }
+    if(num <= c->chunk_num){
+        return;
+    }
+
+    c->chunks = (uint8_t**)realloc(c->chunks, sizeof(uint8_t*) * num);
+    for(; c->chunk_num < num; ++c->chunk_num){
+        c->chunks[c->chunk_num] = (uint8_t*)calloc(1 << CACHE_ARENA_SHIFT, c->page_size);
+        if(c->chunks[c->chunk_num] == NULL){
+            FATAL("alloc arena chunk %u failed", c->chunk_num);
+        }
+    }
 }
 
-kv_page_cache* cache_create(uint32_t pages, uint32_t cache_pages, FILE* f, size_t offset) {
+// without a file, f is NULL, every page is kept in the arena and is never
+// evicted, the lists, page table and cache buffer stay empty
+kv_page_cache* cache_create(uint32_t pages, uint32_t cache_pages, uint32_t page_size, FILE* f, size_t offset) {
     kv_page_cache* c = (kv_page_cache*)malloc(sizeof(kv_page_cache));
+    c->page_size = page_size;
+    c->chunks    = NULL;
+    c->chunk_num = 0;
+    if(f == NULL){
+        cache_pages = 0;
+        cache_arena_resize(c, pages);
+    }
     c->pages  = pages;
     c->cache_pages = cache_pages;
+    c->node_chunks    = NULL;
+    c->node_chunk_num = 0;
+    c->node_pages     = 0;
     c->offset = offset;
     c->f      = f;
-    c->buf    = (uint8_t*)malloc(KV_PAGE_SIZE * cache_pages);
-    memset(c->buf, 0, KV_PAGE_SIZE * cache_pages);
+    c->buf        = NULL;
+    c->buf_size   = 0;
+    c->buf_mapped = false;
+    if(cache_pages > 0){
+        cache_alloc_buf(c, (size_t)page_size * cache_pages);
+    }
     c->items  = (kv_page_cache_item *)malloc(sizeof(kv_page_cache_item) * cache_pages);
     c->dirty  = 0;
+    c->write_hook = NULL;
+    c->write_ptr  = NULL;
+    memset(&c->stats, 0, sizeof(c->stats));
+
+    c->table.slots = NULL;
+    cache_table_resize(&c->table, cache_pages);
 
     list_init(&c->free_list);
     list_init(&c->read_list);
-    cache_init_hash(&c->read_hash);
     list_init(&c->dirty_list);
-    cache_init_hash(&c->dirty_hash);
+    list_init(&c->node_free);
+    list_init(&c->node_list);
 
     for(int i=0; i<cache_pages; ++i){
         kv_page_cache_item* item = c->items + i;
         list_init(&item->list);
-        list_init(&item->hash_list);
-        item->page = (kv_page*)(c->buf + KV_PAGE_SIZE * i);
+        item->page = (kv_page*)(c->buf + (size_t)page_size * i);
         item->dirty = 0;
+        item->node  = 0;
+        item->pins  = 0;
+        item->frame = i;
 
         list_insert_tail(&c->free_list, &item->list);
     }
     return c;
 }
 
+void cache_destroy(kv_page_cache* cache){
+    if(cache == NULL){
+        return;
+    }
+    cache_arena_resize(cache, 0);
+    free(cache->chunks);
+    for(uint32_t i=0; i<cache->node_chunk_num; ++i){
+        // the pages of a chunk are one allocation starting at its first page
+        free(cache->node_chunks[i][0].page);
+        free(cache->node_chunks[i]);
+    }
+    free(cache->node_chunks);
+    cache_free_buf(cache);
+    free(cache->table.slots);
+    free(cache->items);
+    free(cache);
+}
+
 void cache_load_page_from_file(kv_page_cache *c, uint32_t page, void *buf){
-    fseek(c->f, c->offset + KV_PAGE_SIZE * page , SEEK_SET);
-    size_t ret = fread(buf, KV_PAGE_SIZE, 1, c->f);
+    TRACE_BEGIN(TRACE_PAGE_LOAD)
+    fseek(c->f, c->offset + (size_t)c->page_size * page , SEEK_SET);
+    size_t ret = fread(buf, c->page_size, 1, c->f);
     if(ret <= 0){
-        FATAL("load page %d from file error: %d", page, errno)
+        FATAL("load page %d from file error: %d", page, errno);
     }
+    c->stats.pages_read += 1;
+    TRACE_END()
 }
 
 void cache_flush_page_to_file(kv_page_cache* c, uint32_t page, void *buf){
-    fseek(c->f, c->offset + KV_PAGE_SIZE * page , SEEK_SET);
-    size_t ret = fwrite(buf, KV_PAGE_SIZE, 1, c->f);
+    if(c->write_hook != NULL){
+        c->write_hook(c->write_ptr, page);
+    }
+    fseek(c->f, c->offset + (size_t)c->page_size * page , SEEK_SET);
+    size_t ret = fwrite(buf, c->page_size, 1, c->f);
     if(ret <= 0){
-        FATAL("flush page %d from file error: %d", page, errno)
+        FATAL("flush page %d from file error: %d", page, errno);
+    }
+    c->stats.pages_written += 1;
+}
+
+// find the oldest unpinned page of list, walking from the tail, dirty nodes
+// share the dirty list but are never evicted
+kv_page_cache_item* cache_oldest_unpinned(struct cache_list* head){
+    for (struct cache_list* l = list_last(head); l != list_sentinel(head); l = list_prev(l)) {
+        kv_page_cache_item *item = list_data(l, kv_page_cache_item, list);
+        if(item->pins == 0 && !item->node){
+            return item;
+        }
     }
+    return NULL;
+}
+
+// get a frame for a new page: a free one, else evict the oldest clean page,
+// else write back the oldest dirty page and take its frame
+kv_page_cache_item* cache_take_frame(kv_page_cache* cache){
+    if(!list_empty(&cache->free_list)){
+        struct cache_list *l = list_first(&cache->free_list);
+        list_remove(l);
+        return list_data(l, kv_page_cache_item, list);
+    }
+
+    kv_page_cache_item *item = cache_oldest_unpinned(&cache->read_list);
+    if(item == NULL){
+        item = cache_oldest_unpinned(&cache->dirty_list);
+        if(item == NULL){
+            FATAL("all %u cache pages are pinned", cache->cache_pages);
+        }
+        cache_flush_page_to_file(cache, item->page->page, item->page);
+        item->dirty = 0;
+        cache->dirty -= 1;
+        cache->stats.dirty_evictions += 1;
+    }
+    cache_del_item(cache, item);
+    cache->stats.evictions += 1;
+    return item;
+}
+
+// a free frame of the node pool, which grows by a chunk when all are used
+kv_page_cache_item* cache_take_node_frame(kv_page_cache* cache){
+    if(list_empty(&cache->node_free)){
+        uint32_t            num   = 1 << CACHE_NODE_CHUNK_SHIFT;
+        kv_page_cache_item* items = (kv_page_cache_item*)malloc(sizeof(kv_page_cache_item) * num);
+        uint8_t*            buf   = (uint8_t*)malloc((size_t)cache->page_size * num);
+        if(items == NULL || buf == NULL){
+            FATAL("alloc node pool chunk %u failed", cache->node_chunk_num);
+        }
+        // node frames share the page table, keep it at most half full before any is inserted
+        cache_table_resize(&cache->table, cache->cache_pages + ((cache->node_chunk_num + 1) << CACHE_NODE_CHUNK_SHIFT));
+        cache->node_chunks = (kv_page_cache_item**)realloc(cache->node_chunks,
+                                                           sizeof(kv_page_cache_item*) * (cache->node_chunk_num + 1));
+        cache->node_chunks[cache->node_chunk_num] = items;
+        for(uint32_t i=0; i<num; ++i){
+            kv_page_cache_item* item = items + i;
+            list_init(&item->list);
+            item->page  = (kv_page*)(buf + (size_t)cache->page_size * i);
+            item->dirty = 0;
+            item->node  = 1;
+            item->pins  = 0;
+            item->frame = cache->cache_pages + (cache->node_chunk_num << CACHE_NODE_CHUNK_SHIFT) + i;
+            list_insert_tail(&cache->node_free, &item->list);
+        }
+        cache->node_chunk_num += 1;
+    }
+
+    struct cache_list *l = list_first(&cache->node_free);
+    list_remove(l);
+    cache->node_pages += 1;
+    return list_data(l, kv_page_cache_item, list);
+}
+
+// put a frame that holds no page back to the free list of its pool
+void cache_release_frame(kv_page_cache* cache, kv_page_cache_item* item){
+    item->dirty = 0;
+    item->pins  = 0;
+    if(item->node){
+        list_insert_head(&cache->node_free, &item->list);
+        cache->node_pages -= 1;
+    }else{
+        list_insert_head(&cache->free_list, &item->list);
+    }
+}
+
+struct cache_list* cache_clean_list(kv_page_cache* cache, kv_page_cache_item* item){
+    return item->node ? &cache->node_list : &cache->read_list;
 }
 
 kv_page* cache_get_page(kv_page_cache *cache, uint32_t page) {
     if(page >= cache->pages || page <= 0){
-        FATAL("invalid pages: %d, total pages: %d", page, cache->pages)
+        FATAL("invalid pages: %d, total pages: %d", page, cache->pages);
+    }
+    if(cache->f == NULL){
+        return CACHE_ARENA_PAGE(cache, page);
     }
 
-    kv_page_cache_item *item = cache_find_item(&cache->dirty_hash, page);
+    kv_page_cache_item *item = cache_find_item(cache, page);
     if(item != NULL){
+        cache->stats.hits += 1;
         return item->page;
     }
 
-    item = cache_find_item(&cache->read_hash, page);
+    cache->stats.misses += 1;
+    item = cache_take_frame(cache);
+    cache_load_page_from_file(cache, page, item->page);
+    if(item->page->page != page){
+        FATAL("invalid page load from file: %d %d", item->page->page, page);
+    }
+
+    // the type is only known once the page is read, nodes are copied into their pool
+    if(item->page->type == KV_PAGE_NODE){
+        kv_page_cache_item* node = cache_take_node_frame(cache);
+        memcpy(node->page, item->page, cache->page_size);
+        cache_release_frame(cache, item);
+        item = node;
+    }
+    cache_add_item(cache, cache_clean_list(cache, item), item);
+    return item->page;
+}
+
+// cache page without reading it, for pages whose old content is discarded,
+// the caller sets the header and marks the page dirty
+kv_page* cache_new_page(kv_page_cache *cache, uint32_t page){
+    if(page >= cache->pages || page <= 0){
+        FATAL("invalid pages: %d, total pages: %d", page, cache->pages);
+    }
+    if(cache->f == NULL){
+        return CACHE_ARENA_PAGE(cache, page);
+    }
+
+    kv_page_cache_item *item = cache_find_item(cache, page);
     if(item != NULL){
         return item->page;
     }
 
-    if(list_empty(&cache->free_list)){
-        item = remove_tail_from_read_list(cache);
-        list_insert_head(&cache->free_list, &item->list);
+    item = cache_take_frame(cache);
+    item->page->page = page;
+    cache_add_item(cache, &cache->read_list, item);
+    return item->page;
+}
+
+// move a cached page whose type was just set into the pool of that type, internal
+// nodes into the node pool and pages that stopped being nodes back out of it. the
+// page may move, pointers to it taken before the call must not be used after it
+kv_page* cache_place_page(kv_page_cache *cache, uint32_t page, bool node){
+    if(cache->f == NULL){
+        return CACHE_ARENA_PAGE(cache, page);
     }
 
-    if(!list_empty(&cache->free_list)){
-        struct cache_list *l = list_first(&cache->free_list);
-        list_remove(l);
+    kv_page_cache_item *item = cache_find_item(cache, page);
+    if(item == NULL){
+        cache_get_page(cache, page);
+        item = cache_find_item(cache, page);
+    }
+    if(item->node == node){
+        return item->page;
+    }
 
-        kv_page_cache_item *item = list_data(l, kv_page_cache_item, list);
-        cache_load_page_from_file(cache, page, item->page);
-        if(item->page->page != page){
-            FATAL("invalid page load from file: %d %d", item->page->page, page);
-        }
+    // taking a frame never evicts a node, so item stays where it is until released
+    kv_page_cache_item *to = node ? cache_take_node_frame(cache) : cache_take_frame(cache);
+    memcpy(to->page, item->page, cache->page_size);
+    to->dirty = item->dirty;
+    to->pins  = item->pins;
+    cache_del_item(cache, item);
+    cache_add_item(cache, to->dirty ? &cache->dirty_list : cache_clean_list(cache, to), to);
+    cache_release_frame(cache, item);
+    return to->page;
+}
 
-        add_item_to_hash(&cache->read_hash, &cache->read_list, item);
-        return item->page;
+kv_page* cache_pin_page(kv_page_cache *cache, uint32_t page){
+    kv_page* p = cache_get_page(cache, page);
+    if(cache->f == NULL){
+        return p;
     }
+    cache_find_item(cache, page)->pins += 1;
+    return p;
+}
+
+void cache_unpin_page(kv_page_cache *cache, uint32_t page){
+    if(cache->f == NULL){
+        return;
+    }
+    kv_page_cache_item *item = cache_find_item(cache, page);
+    if(item == NULL || item->pins == 0){
+        FATAL("unpin page %u which is not pinned", page);
+    }
+    item->pins -= 1;
+}
 
-    FATAL("cache page %u cache out of memory", page)
+void cache_set_write_hook(kv_page_cache* cache, cache_write_hook hook, void* ptr){
+    cache->write_hook = hook;
+    cache->write_ptr  = ptr;
 }
 
 void cache_set_page_num(kv_page_cache* cache, uint32_t pages){
+    if(cache->f == NULL){
+        cache_arena_resize(cache, pages);
+    }
     cache->pages = pages;
 }
 
 void cache_set_page_dirty(kv_page_cache* cache, uint32_t page){
     //DEBUG("dirty page: %d", page)
-    kv_page_cache_item *item = cache_find_item(&cache->dirty_hash, page);
-    if(item != NULL){
-        return;
-    }
-
-    item = cache_find_item(&cache->read_hash, page);
-    if(item != NULL){
+    kv_page_cache_item *item = cache_find_item(cache, page);
+    if(item != NULL && !item->dirty){
         item->dirty = 1;
         cache->dirty += 1;
-        del_item_from_hash(item);
-        add_item_to_hash(&cache->dirty_hash, &cache->dirty_list, item);
+        list_remove(&item->list);
+        list_insert_head(&cache->dirty_list, &item->list);
     }
 }
 
 bool cache_flush_dirty(kv_page_cache*cache, bool force){
+    if(cache->f == NULL){
+        return false;
+    }
     if(!force && cache->dirty < cache->cache_pages/2){
         return false;
     }
 
+    TRACE_BEGIN(TRACE_FLUSH)
+    uint64_t begin = cache_now_usec();
     for (struct cache_list* l = list_first(&cache->dirty_list); l != list_sentinel(&cache->dirty_list);) {
         kv_page_cache_item *item = list_data(l, kv_page_cache_item, list);
         l = list_next(l);
 
-        del_item_from_hash(item);
         item->dirty = 0;
         cache_flush_page_to_file(cache, item->page->page, item->page);
 
-        list_insert_head(&cache->free_list, &item->list);
+        // flushed pages stay cached as clean pages
+        list_remove(&item->list);
+        list_insert_head(cache_clean_list(cache, item), &item->list);
     }
     cache->dirty = 0;
+    TRACE_END()
+
+    uint64_t cost = cache_now_usec() - begin;
+    cache->stats.flushes    += 1;
+    cache->stats.flush_usec += cost;
+    if(cost > cache->stats.flush_usec_max){
+        cache->stats.flush_usec_max = cost;
+    }
     return true;
 }
+
+void cache_get_stats(kv_page_cache* cache, kv_cache_stats* stats){
+    *stats = cache->stats;
+    stats->cache_pages = cache->cache_pages;
+    stats->node_pages  = cache->node_pages;
+    stats->dirty       = cache->dirty;
+}
+
+uint32_t cache_list_pages(struct cache_list* head, uint32_t* pages, uint32_t num, uint32_t max, int type){
+    for (struct cache_list* l = list_first(head); l != list_sentinel(head) && num < max; l = list_next(l)) {
+        kv_page_cache_item *item = list_data(l, kv_page_cache_item, list);
+        if((type == KV_PAGE_NODE) == (item->page->type == KV_PAGE_NODE)){
+            pages[num++] = item->page->page;
+        }
+    }
+    return num;
+}
+
+// list cached page numbers, internal nodes first and then the most recently loaded
+uint32_t cache_resident_pages(kv_page_cache* cache, uint32_t* pages, uint32_t max){
+    uint32_t num = 0;
+    num = cache_list_pages(&cache->dirty_list, pages, num, max, KV_PAGE_NODE);
+    num = cache_list_pages(&cache->node_list, pages, num, max, KV_PAGE_NODE);
+    num = cache_list_pages(&cache->dirty_list, pages, num, max, KV_PAGE_DATA);
+    num = cache_list_pages(&cache->read_list, pages, num, max, KV_PAGE_DATA);
+    return num;
+}
+
+// load sorted pages into free cache slots with large sequential reads,
+// returns the number of pages loaded
+uint32_t cache_prefetch(kv_page_cache* cache, const uint32_t* pages, uint32_t num){
+    uint8_t* buf = (uint8_t*)malloc((size_t)cache->page_size * CACHE_PREFETCH_RUN);
+    uint32_t loaded = 0;
+    for(uint32_t i=0; i<num && !list_empty(&cache->free_list);){
+        uint32_t first = pages[i];
+        if(first <= 0 || first >= cache->pages){
+            ++i;
+            continue;
+        }
+
+        uint32_t j = i + 1;
+        for(; j<num && pages[j] < cache->pages && pages[j] - first < CACHE_PREFETCH_RUN &&
+              pages[j] - pages[j-1] <= CACHE_PREFETCH_GAP; ++j){
+        }
+        uint32_t last = pages[j-1];
+
+        fseek(cache->f, cache->offset + (size_t)cache->page_size * first, SEEK_SET);
+        size_t ret = fread(buf, cache->page_size, last - first + 1, cache->f);
+        cache->stats.pages_read += ret;
+
+        for(; i<j; ++i){
+            kv_page* src = (kv_page*)(buf + (size_t)cache->page_size * (pages[i] - first));
+            if(pages[i] - first >= ret || src->page != pages[i] || cache_find_item(cache, pages[i]) != NULL){
+                continue;
+            }
+
+            kv_page_cache_item *item;
+            if(src->type == KV_PAGE_NODE){
+                item = cache_take_node_frame(cache);
+            }else if(!list_empty(&cache->free_list)){
+                struct cache_list *l = list_first(&cache->free_list);
+                list_remove(l);
+                item = list_data(l, kv_page_cache_item, list);
+            }else{
+                continue;
+            }
+            memcpy(item->page, src, cache->page_size);
+            cache_add_item(cache, cache_clean_list(cache, item), item);
+            ++loaded;
+        }
+        i = j;
+    }
+    free(buf);
+    return loaded;
+}
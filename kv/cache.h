@@ -6,11 +6,37 @@
 
 typedef struct __kv_page_cache kv_page_cache;
 
-kv_page_cache* cache_create(uint32_t pages, uint32_t cache_pages, FILE* f, size_t offset);
+typedef struct __kv_cache_stats{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t dirty_evictions;
+    uint64_t pages_read;
+    uint64_t pages_written;
+    uint64_t flushes;
+    uint64_t flush_usec;
+    uint64_t flush_usec_max;
+    uint32_t cache_pages;
+    uint32_t node_pages;
+    uint32_t dirty;
+}kv_cache_stats;
+
+// called before a cached page overwrites its copy in the file
+typedef void (*cache_write_hook)(void* ptr, uint32_t page);
+
+kv_page_cache* cache_create(uint32_t pages, uint32_t cache_pages, uint32_t page_size, FILE* f, size_t offset);
 void  cache_destroy(kv_page_cache* cache);
 kv_page* cache_get_page(kv_page_cache *cache, uint32_t page);
+kv_page* cache_new_page(kv_page_cache *cache, uint32_t page);
+kv_page* cache_place_page(kv_page_cache *cache, uint32_t page, bool node);
+kv_page* cache_pin_page(kv_page_cache *cache, uint32_t page);
+void cache_unpin_page(kv_page_cache *cache, uint32_t page);
+void cache_set_write_hook(kv_page_cache* cache, cache_write_hook hook, void* ptr);
 void cache_set_page_num(kv_page_cache* cache, uint32_t pages);
 void cache_set_page_dirty(kv_page_cache* cache, uint32_t page);
 bool cache_flush_dirty(kv_page_cache*cache, bool force);
+void cache_get_stats(kv_page_cache* cache, kv_cache_stats* stats);
+uint32_t cache_resident_pages(kv_page_cache* cache, uint32_t* pages, uint32_t max);
+uint32_t cache_prefetch(kv_page_cache* cache, const uint32_t* pages, uint32_t num);
 
 #endif//__KV_PAGE_CACHE_H__
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "check.h"
+#include "scan.h"
+#include "log.h"
+
+// only the first problems are logged, all of them are counted
+#define CHECK_MAX_REPORT 64
+// don't start a worker for fewer pages than this
+#define CHECK_MIN_PAGES_PER_WORKER 64
+
+#define CHECK_REPORT(__CTX__, __FIELD__, __FMT__, ...) \
+    __FIELD__ += 1; \
+    if(__atomic_fetch_add(&(__CTX__)->reported, 1, __ATOMIC_RELAXED) < CHECK_MAX_REPORT){ \
+        ERROR(__FMT__, ##__VA_ARGS__); \
+    }
+
+typedef struct __check_item{
+    uint32_t page;
+    uint32_t parent;
+    int64_t  lo;
+    int64_t  hi;
+    uint8_t  has_lo;
+    uint8_t  has_hi;
+}check_item;
+
+typedef struct __check_ctx{
+    int       fd;
+    size_t    offset;
+    uint32_t  page_size;
+    uint16_t  order;
+    scan_unpack_fn unpack;
+    uint32_t  page_num;
+    uint8_t*  bitmap;
+    uint64_t  reported;
+}check_ctx;
+
+typedef struct __check_worker{
+    pthread_t       tid;
+    check_ctx*      ctx;
+    check_item*     items;
+    kv_record*      unpacked;
+    uint16_t*       types;
+    uint32_t*       nexts;
+    uint32_t        begin;
+    uint32_t        end;
+    check_item*     children;
+    uint32_t        child_num;
+    uint32_t        child_cap;
+    kv_check_result result;
+}check_worker;
+
+// set the visited bit of page, false if it was already set
+bool check_mark(check_ctx* ctx, uint32_t page){
+    uint8_t bit = 1 << (page & 7);
+    uint8_t old = __atomic_fetch_or(ctx->bitmap + (page >> 3), bit, __ATOMIC_RELAXED);
+    return (old & bit) == 0;
+}
+
+bool check_marked(check_ctx* ctx, uint32_t page){
+    return (ctx->bitmap[page >> 3] & (1 << (page & 7))) != 0;
+}
+
+void check_add_child(check_worker* w, uint32_t page, uint32_t parent, check_item* bound){
+    if(w->child_num >= w->child_cap){
+        w->child_cap = w->child_cap > 0 ? w->child_cap * 2 : 256;
+        w->children  = (check_item*)realloc(w->children, sizeof(check_item) * w->child_cap);
+    }
+    check_item* c = w->children + w->child_num++;
+    *c = *bound;
+    c->page   = page;
+    c->parent = parent;
+}
+
+void check_page(check_worker* w, uint32_t n, kv_page* p){
+    check_ctx*  ctx  = w->ctx;
+    check_item* item = w->items + n;
+    kv_check_result* r = &w->result;
+    w->types[n] = 0;
+
+    if(item->page == NULL_PAGE || item->page >= ctx->page_num){
+        CHECK_REPORT(ctx, r->bad_page_id, "page %u referenced by %u is out of range", item->page, item->parent)
+        return;
+    }
+    if(!check_mark(ctx, item->page)){
+        CHECK_REPORT(ctx, r->duplicate_pages, "page %u referenced by %u is already referenced", item->page, item->parent)
+        return;
+    }
+    if(!scan_pread_page(ctx->fd, ctx->offset, ctx->page_size, item->page, p)){
+        CHECK_REPORT(ctx, r->bad_page_id, "page %u read error: %d", item->page, errno)
+        return;
+    }
+    if(p->page != item->page){
+        CHECK_REPORT(ctx, r->bad_page_id, "page %u has self id %u", item->page, p->page)
+        return;
+    }
+    if(p->parent != item->parent){
+        CHECK_REPORT(ctx, r->bad_parent, "page %u has parent %u, referenced by %u", item->page, p->parent, item->parent)
+    }
+    if((p->type != KV_PAGE_DATA && p->type != KV_PAGE_NODE) || p->record_num > ctx->order){
+        CHECK_REPORT(ctx, r->bad_type, "page %u has type %u record num %u", item->page, p->type, p->record_num)
+        return;
+    }
+
+    r->tree_pages += 1;
+    if(item->parent != NULL_PAGE && p->record_num < KV_PAGE_MIN_RECORDS(ctx->order)){
+        r->underfull_pages += 1;
+    }
+
+    kv_record* records = KV_PAGE_RECORDS(p);
+    if(ctx->unpack != NULL){
+        ctx->unpack(p, w->unpacked);
+        records = w->unpacked;
+    }
+    for(uint16_t i=0; i<p->record_num; ++i){
+        int64_t key = records[i].key;
+        if(i > 0 && key <= records[i-1].key){
+            CHECK_REPORT(ctx, r->bad_order, "page %u key %ld at %u not above %ld", item->page, key, i, records[i-1].key)
+            break;
+        }
+        if((item->has_lo && key < item->lo) || (item->has_hi && key >= item->hi)){
+            CHECK_REPORT(ctx, r->bad_bound, "page %u key %ld at %u out of separator bounds [%ld, %ld)",
+                         item->page, key, i, item->lo, item->hi)
+            break;
+        }
+    }
+
+    w->types[n] = p->type;
+    if(p->type == KV_PAGE_DATA){
+        w->nexts[n] = p->next_page;
+        r->records += p->record_num;
+        return;
+    }
+
+    // child i holds keys in [records[i-1].key, records[i].key)
+    for(uint16_t i=0; i<=p->record_num; ++i){
+        check_item bound = *item;
+        if(i > 0){
+            bound.lo     = records[i-1].key;
+            bound.has_lo = 1;
+        }
+        if(i < p->record_num){
+            bound.hi     = records[i].key;
+            bound.has_hi = 1;
+        }
+        check_add_child(w, records[i].value, item->page, &bound);
+    }
+}
+
+void* check_worker_run(void* arg){
+    check_worker* w = (check_worker*)arg;
+    kv_page*      p = (kv_page*)malloc(w->ctx->page_size);
+    // records take at least 8 bytes in a page and 16 once unpacked
+    w->unpacked = w->ctx->unpack != NULL ? (kv_record*)malloc((size_t)w->ctx->page_size * 2) : NULL;
+    for(uint32_t n=w->begin; n<w->end; ++n){
+        check_page(w, n, p);
+    }
+    free(p);
+    free(w->unpacked);
+    return NULL;
+}
+
+void check_merge_result(kv_check_result* to, kv_check_result* from){
+    to->tree_pages      += from->tree_pages;
+    to->underfull_pages += from->underfull_pages;
+    to->records         += from->records;
+    to->bad_page_id     += from->bad_page_id;
+    to->bad_type        += from->bad_type;
+    to->bad_order       += from->bad_order;
+    to->bad_bound       += from->bad_bound;
+    to->bad_parent      += from->bad_parent;
+    to->duplicate_pages += from->duplicate_pages;
+}
+
+// check one level of the tree in parallel, returns the next level
+check_item* check_level(check_ctx* ctx, check_item* items, uint32_t num, uint16_t nthreads,
+                        kv_check_result* result, uint32_t* next_num){
+    uint16_t* types = (uint16_t*)malloc(sizeof(uint16_t) * num);
+    uint32_t* nexts = (uint32_t*)malloc(sizeof(uint32_t) * num);
+
+    uint32_t workers_num = (num + CHECK_MIN_PAGES_PER_WORKER - 1) / CHECK_MIN_PAGES_PER_WORKER;
+    if(workers_num > nthreads){
+        workers_num = nthreads;
+    }
+    check_worker* workers = (check_worker*)calloc(workers_num, sizeof(check_worker));
+    for(uint32_t i=0; i<workers_num; ++i){
+        check_worker* w = workers + i;
+        w->ctx   = ctx;
+        w->items = items;
+        w->types = types;
+        w->nexts = nexts;
+        w->begin = (uint64_t)num * i / workers_num;
+        w->end   = (uint64_t)num * (i + 1) / workers_num;
+        if(pthread_create(&w->tid, NULL, check_worker_run, w) != 0){
+            FATAL("create check worker failed with errno: %d", errno);
+        }
+    }
+
+    *next_num = 0;
+    for(uint32_t i=0; i<workers_num; ++i){
+        pthread_join(workers[i].tid, NULL);
+        check_merge_result(result, &workers[i].result);
+        *next_num += workers[i].child_num;
+    }
+
+    // children are concatenated in worker order so the next level stays in key order
+    check_item* next = (check_item*)malloc(sizeof(check_item) * (*next_num + 1));
+    uint32_t    pos  = 0;
+    for(uint32_t i=0; i<workers_num; ++i){
+        // a worker on the leaf level has no children and never allocated them
+        if(workers[i].child_num > 0){
+            memcpy(next + pos, workers[i].children, sizeof(check_item) * workers[i].child_num);
+            pos += workers[i].child_num;
+        }
+        free(workers[i].children);
+    }
+    free(workers);
+
+    // all leaves must be on the same level and chained in key order
+    uint32_t leaves = 0, nodes = 0;
+    for(uint32_t n=0; n<num; ++n){
+        leaves += types[n] == KV_PAGE_DATA;
+        nodes  += types[n] == KV_PAGE_NODE;
+    }
+    if(leaves > 0 && nodes > 0){
+        CHECK_REPORT(ctx, result->unbalanced, "level mixes %u leaves and %u nodes", leaves, nodes)
+    }else if(leaves > 0){
+        for(uint32_t n=0; n<num; ++n){
+            uint32_t expect = n + 1 < num ? items[n+1].page : NULL_PAGE;
+            if(types[n] == KV_PAGE_DATA && nexts[n] != expect){
+                CHECK_REPORT(ctx, result->bad_next, "leaf %u next page %u, expect %u", items[n].page, nexts[n], expect)
+            }
+        }
+    }
+
+    free(types);
+    free(nexts);
+    return next;
+}
+
+void check_free_list(check_ctx* ctx, uint32_t free_page, kv_check_result* result){
+    kv_page* p = (kv_page*)malloc(ctx->page_size);
+    for(uint32_t page = free_page; page != NULL_PAGE;){
+        if(page >= ctx->page_num){
+            CHECK_REPORT(ctx, result->bad_free, "free page %u is out of range", page)
+            break;
+        }
+        if(!check_mark(ctx, page)){
+            CHECK_REPORT(ctx, result->bad_free, "free page %u is already referenced", page)
+            break;
+        }
+        if(!scan_pread_page(ctx->fd, ctx->offset, ctx->page_size, page, p) || p->page != page){
+            CHECK_REPORT(ctx, result->bad_free, "free page %u is unreadable or has wrong self id", page)
+            break;
+        }
+        result->free_pages += 1;
+        page = p->next_page;
+    }
+    free(p);
+}
+
+int check_tree(int fd, size_t offset, uint32_t page_size, uint16_t order, scan_unpack_fn unpack, const uint32_t* roots,
+               uint32_t root_num, uint32_t free_page, uint32_t page_hwm, uint32_t page_num, uint16_t nthreads,
+               kv_check_result* result){
+    memset(result, 0, sizeof(kv_check_result));
+    result->page_num = page_num;
+
+    // pages above the high-water mark were never used, tree and free list stay below it
+    check_ctx ctx = {.fd = fd, .offset = offset, .page_size = page_size, .order = order, .unpack = unpack,
+                     .page_num = page_hwm, .reported = 0};
+    ctx.bitmap = (uint8_t*)calloc(page_num / 8 + 1, 1);
+    if(nthreads == 0){
+        nthreads = 1;
+    }
+
+    // trees are checked one by one since each has its own leaf chain
+    for(uint32_t r=0; r<root_num; ++r){
+        uint32_t    num    = 1;
+        uint32_t    height = 0;
+        check_item* items  = (check_item*)calloc(1, sizeof(check_item));
+        items[0].page   = roots[r];
+        items[0].parent = NULL_PAGE;
+        for(; num > 0;){
+            height += 1;
+            check_item* next = check_level(&ctx, items, num, nthreads, result, &num);
+            free(items);
+            items = next;
+        }
+        free(items);
+        if(height > result->height){
+            result->height = height;
+        }
+    }
+
+    check_free_list(&ctx, free_page, result);
+    result->free_pages += page_num - page_hwm;
+
+    // page 0 is reserved for the catalog
+    for(uint32_t page=1; page<page_hwm; ++page){
+        if(!check_marked(&ctx, page)){
+            CHECK_REPORT(&ctx, result->leaked_pages, "page %u is neither in the tree nor in the free list", page)
+        }
+    }
+    free(ctx.bitmap);
+
+    result->errors = result->bad_page_id + result->bad_type + result->bad_order + result->bad_bound +
+                     result->bad_parent + result->bad_next + result->unbalanced + result->duplicate_pages +
+                     result->leaked_pages + result->bad_free;
+    return result->errors > 0 ? CODE_CORRUPTED : CODE_SUCCEED;
+}
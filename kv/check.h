@@ -0,0 +1,10 @@
+#ifndef __KV_CHECK_H__
+#define __KV_CHECK_H__
+#include "kv.h"
+#include "scan.h"
+
+int check_tree(int fd, size_t offset, uint32_t page_size, uint16_t order, scan_unpack_fn unpack, const uint32_t* roots,
+               uint32_t root_num, uint32_t free_page, uint32_t page_hwm, uint32_t page_num, uint16_t nthreads,
+               kv_check_result* result);
+
+#endif//__KV_CHECK_H__
@@ -19,15 +19,30 @@ typedef struct __kv_record{
 }kv_record;
 #pragma pack()
 
-#define KV_MAGIC 0xefefefef
-#define KV_PAGE_SIZE 4*1024
-
-#define KV_ORDER ((KV_PAGE_SIZE - sizeof(kv_page)) / sizeof(kv_record) - 2)
-//#define KV_ORDER 5
-#define KV_MIN_RECORDS ((KV_ORDER+1)/2 - 1)
+// files written before the page size was stored have 4k pages of 64 bit keys and values
+// and this magic, which such files still get. newer files keep the record layout in
+// byte 1 and log2 of the page size in byte 0 of KV_MAGIC_SIZED
+#define KV_MAGIC        0xefefefef
+#define KV_MAGIC_SIZED  0xefef0000
+#define KV_PAGE_SIZE_MIN (4*1024)
+#define KV_PAGE_SIZE_MAX (64*1024)
+
+// record layouts by key and value width, 64 bit keys and values keep the 0xef every
+// magic had in byte 1 before the layout was stored
+#define KV_LAYOUT_K64V64 0xef
+#define KV_LAYOUT_K32V32 1
+#define KV_LAYOUT_K64V32 2
+#define KV_LAYOUT_K32V64 3
+
+// page size and layout are chosen when a file is created, order and minimum follow from them
+#define KV_PAGE_ORDER(__SIZE__, __RECORD__) (((__SIZE__) - sizeof(kv_page)) / (__RECORD__) - 2)
+#define KV_PAGE_MIN_RECORDS(__ORDER__) (((__ORDER__)+1)/2 - 1)
+// with lazy delete leaves are only rebalanced at once below this
+#define KV_PAGE_LAZY_MIN_RECORDS(__ORDER__) (KV_PAGE_MIN_RECORDS(__ORDER__) / 4)
 
 #define KV_PAGE_NODE 1
 #define KV_PAGE_DATA 2
+#define KV_PAGE_META 3
 
 #define KV_PAGE_RECORDS(__P__)((kv_record*) (((uint8_t*)(__P__)) +(offsetof(kv_page, record_num) + sizeof(uint16_t))))
 #define NULL_PAGE 0
@@ -36,5 +51,8 @@ typedef struct __kv_record{
 #define CODE_SUCCEED 0
 #define CODE_INVALID_PARAMETER 1
 #define CODE_KEY_NOT_EXIST 2
+#define CODE_CORRUPTED 3
+#define CODE_IO_ERROR 4
+#define CODE_VALUE_MISMATCH 5
 
 #endif//__KV_DEFINE_H__
@@ -0,0 +1,145 @@
+#ifndef __KV_INTERNAL_H__
+#define __KV_INTERNAL_H__
+#include <stdio.h>
+#include "kv.h"
+#include "cache.h"
+#include "scan.h"
+
+// a leaf left underfull by a lazy delete, key routes a descent back to it
+typedef struct __kv_pending{
+    kv_tree* tree;
+    uint32_t page;
+    int64_t  key;
+}kv_pending;
+
+// the leaf the last put of a tree descended to and the separators around it, has_lo
+// and has_hi are false on the leftmost and rightmost paths. it is only trusted while
+// tree_version of the file is the one it was taken at
+typedef struct __kv_leaf_hint{
+    uint32_t page;
+    bool     has_lo;
+    bool     has_hi;
+    int64_t  lo;
+    int64_t  hi;
+    uint64_t version;
+}kv_leaf_hint;
+
+struct __kv_tree{
+    kv_file*     kv;
+    uint32_t     root;
+    char         name[KV_TREE_NAME_SIZE];
+    kv_leaf_hint hint;
+};
+
+// catalog of named trees kept in page 0
+typedef struct __kv_catalog_entry{
+    char     name[KV_TREE_NAME_SIZE];
+    uint32_t root;
+}kv_catalog_entry;
+
+// kept in the last bytes of page 0, behind the catalog
+typedef struct __kv_meta{
+    uint32_t page_hwm;
+    uint32_t magic;
+}kv_meta;
+
+// the catalog is sized for the smallest page, larger pages leave the rest unused
+#define KV_TREE_MAX ((KV_PAGE_SIZE_MIN - sizeof(kv_page) - sizeof(kv_meta)) / sizeof(kv_catalog_entry))
+
+// the tree code compiled by tree.h for one record layout, a file picks its layout
+// when it is opened so the operations below never look at key or value widths
+typedef struct __kv_layout{
+    uint8_t   id;
+    uint8_t   key_bits;
+    uint8_t   value_bits;
+    uint16_t  record_size;
+    int       (*put)(kv_tree* t, int64_t key, int64_t value);
+    int       (*get)(kv_tree* t, int64_t key, int64_t* value);
+    int       (*del)(kv_tree* t, int64_t key);
+    int       (*del_range)(kv_tree* t, int64_t min, int64_t max);
+    int       (*update)(kv_tree* t, int64_t key, kv_update_fn fn, void* ctx);
+    int       (*next)(kv_tree* t, int64_t sk, int64_t* key, int64_t* value);
+    void      (*range)(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, int64_t, int64_t));
+    void      (*range_spans)(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, const kv_span*));
+    uint32_t  (*range_copy)(kv_tree* t, int64_t min, int64_t max, kv_record* out, uint32_t num);
+    void      (*range_aggregate)(kv_tree* t, int64_t min, int64_t max, kv_aggregate* result);
+    void      (*iterate)(kv_tree* t, void* ptr, void(*f)(void*, uint16_t, int64_t, int64_t));
+    int       (*apply_batch)(kv_tree* t, kv_op* ops, uint32_t num);
+    uint32_t  (*maintain)(kv_file* kv);
+    void      (*page_set)(kv_file* kv, kv_page* p, int64_t key, int64_t value);
+    kv_page*  (*leftmost_leaf)(kv_file* kv, uint32_t page);
+    uint32_t* (*expand_level)(kv_file* kv, uint32_t* level, uint32_t num, uint32_t* next_num);
+    void      (*print)(kv_file* kv);
+    int       (*dump)(kv_tree* t, int fd);
+    int       (*load)(kv_tree* t, int fd);
+    scan_unpack_fn unpack;
+}kv_layout;
+
+extern const kv_layout kv_layout_k64v64;
+extern const kv_layout kv_layout_k32v32;
+extern const kv_layout kv_layout_k64v32;
+extern const kv_layout kv_layout_k32v64;
+
+// the only part of kv_file kept on disk, it starts the file and pages follow it
+#pragma pack(1)
+typedef struct __kv_file_header{
+    uint32_t magic;
+    uint32_t root;
+    uint32_t free;
+    uint32_t page_num;
+}kv_file_header;
+#pragma pack()
+
+#define KV_FILE_HEADER_SIZE sizeof(kv_file_header)
+
+struct __kv_file{
+    kv_file_header header;
+    kv_page_cache* cache;
+    FILE* f;
+    char* name;
+    kv_stats stats;
+    uint32_t* pinned;
+    uint32_t  pinned_num;
+    uint32_t  pinned_cap;
+    bool        lazy_delete;
+    bool        warm_cache;
+    kv_pending* pending;
+    uint32_t    pending_num;
+    uint32_t    pending_cap;
+    kv_tree     main;
+    kv_tree*    trees[KV_TREE_MAX];
+    uint16_t    tree_num;
+    kv_backup_job* backup;
+    // pages from page_hwm to page_num were never handed out and are not in the free list
+    uint32_t    page_hwm;
+    // taken from the magic, order and min_records bound the records of every page
+    uint32_t    page_size;
+    const kv_layout* layout;
+    uint16_t    order;
+    uint16_t    min_records;
+    uint8_t*    buf;
+    // bumped whenever a separator changes or a page is freed, which invalidates leaf hints
+    uint64_t    tree_version;
+};
+
+// deeper than any tree 32 bit page numbers can address
+#define KV_MAX_HEIGHT  32
+// lazy deletes rebalance the pending leaves once this many have piled up
+#define KV_LAZY_BATCH  1024
+// records per read or write of a dump stream, a leaf may carry a write past it
+#define KV_DUMP_BATCH   4096
+// bulk loaded pages are filled up to one record below a split
+#define KV_LOAD_LEAF_RECORDS(__KV__)  ((__KV__)->order - 1)
+#define KV_LOAD_NODE_CHILDREN(__KV__) ((__KV__)->order)
+
+kv_page* kv_page_at(kv_file* kv, uint32_t page);
+kv_page* kv_page_pin(kv_file* kv, uint32_t page);
+void kv_unpin_all(kv_file* kv);
+void kv_page_set_parent(kv_file* kv, uint32_t page, uint32_t parent);
+void kv_page_free(kv_file* kv, kv_page* p);
+void kv_dirty_page(kv_file* kv, uint32_t page);
+void kv_dirty_flush(kv_file* kv, bool force);
+int  kv_write_full(int fd, const void* buf, size_t size);
+int  kv_read_full(int fd, void* buf, size_t size, size_t* got);
+
+#endif//__KV_INTERNAL_H__
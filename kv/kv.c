@@ -1,41 +1,102 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <signal.h>
-#include "kv.h"
-#include "cache.h"
+#include <string.h>
+#include "internal.h"
+#include "check.h"
+#include "trace.h"
 #include "log.h"
 
-#pragma pack(1)
-struct __kv_file{
-    uint32_t magic;
-    uint32_t root;
-    uint32_t free;
-    uint32_t page_num;
-    kv_page_cache* cache;
-    FILE* f;
-    uint8_t buf[KV_PAGE_SIZE];
+#define KV_CATALOG_PAGE 0
+#define KV_META_MAGIC   0x6174656d
+#define KV_PAGE_META_TAIL(__P__, __SIZE__) ((kv_meta*)((uint8_t*)(__P__) + (__SIZE__) - sizeof(kv_meta)))
+
+// online backup of the image the file held at kv_backup_begin, pages overwritten
+// before the copy reaches them are saved first
+struct __kv_backup_job{
+    kv_file*  kv;
+    int       fd;
+    uint32_t  page_num;
+    uint32_t  next;
+    uint8_t** saved;
+    uint8_t*  buf;
+    int       error;
 };
-#pragma pack()
-
-kv_page* kv_page_at(kv_file* kv, uint32_t page);
-kv_page* kv_find_leaf_page(kv_file* kv, kv_page* p, int64_t key);
-uint16_t kv_find_child_index(kv_page* p, int64_t key);
-void kv_page_merge_if_need(kv_file* kv, kv_page* p);
-void kv_page_del(kv_file* kv, kv_page* p, int64_t key);
-void kv_page_split_if_need(kv_file* kv, kv_page* p);
-uint16_t kv_page_find_insert_index(kv_page* p, int64_t key);
-int  kv_initialize(const char* name);
-void kv_dirty_page(kv_file* kv, uint32_t page);
-void kv_dirty_flush(kv_file* kv, bool force);
+
+// dump stream: this header followed by key ordered records up to the end of the stream
+typedef struct __kv_dump_header{
+    uint32_t magic;
+    uint32_t version;
+}kv_dump_header;
+
+void kv_extend_file(kv_file* kv, uint32_t num);
+uint32_t kv_extend_pages(kv_file* kv);
+int  kv_initialize(const char* name, uint32_t magic);
+uint32_t kv_magic_page_size(uint32_t magic);
+const kv_layout* kv_magic_layout(uint32_t magic);
+uint32_t kv_file_magic(uint32_t page_size, const kv_layout* layout);
+const kv_layout* kv_options_layout(const kv_options* opts);
+void kv_file_init(kv_file* kv, FILE* f, const char* name, const kv_options* opts);
+kv_file* kv_open_memory(const kv_options* opts, uint32_t magic);
 void kv_set_signal_handler(kv_file* kv);
+void kv_warm_save(kv_file* kv);
+void kv_warm_load(kv_file* kv);
+void kv_catalog_load(kv_file* kv);
+void kv_catalog_save(kv_file* kv);
+void kv_backup_preserve(void* ptr, uint32_t page);
 kv_file *_kv_for_signal = NULL;
 
+#define KV_WARM_MAGIC      0x6d72776b
+#define KV_WARM_SUFFIX     ".warm"
+#define KV_WARM_TMP_SUFFIX ".tmp"
+// the file grows by half its size, within these bounds counted in 4k pages
+#define KV_EXTEND_MIN_PAGES 1024
+#define KV_EXTEND_MAX_PAGES (64 * 1024)
+// backups are copied in runs of this many pages
+#define KV_BACKUP_CHUNK 256
+#define KV_DUMP_MAGIC   0x706d646b
+#define KV_DUMP_VERSION 1
+
+void kv_options_init(kv_options* opts){
+    opts->cache_pages = KV_DEFAULT_CACHE_PAGES;
+    opts->page_size   = KV_DEFAULT_PAGE_SIZE;
+    opts->key_bits    = 64;
+    opts->value_bits  = 64;
+    opts->warm_cache  = false;
+    opts->lazy_delete = false;
+}
+
 kv_file* kv_open(const char* name){
-    int ret = kv_initialize(name);
+    return kv_open_ex(name, NULL);
+}
+
+kv_file* kv_open_ex(const char* name, const kv_options* opts){
+    kv_options defaults;
+    if(opts == NULL){
+        kv_options_init(&defaults);
+        opts = &defaults;
+    }
+    const kv_layout* layout = kv_options_layout(opts);
+    if(layout == NULL){
+        WARN("invalid key bits %u value bits %u, use 64 and 64", opts->key_bits, opts->value_bits);
+        layout = &kv_layout_k64v64;
+    }
+    uint32_t page_size = opts->page_size;
+    if(kv_file_magic(page_size, layout) == 0){
+        WARN("invalid page size %u, use %u", page_size, KV_DEFAULT_PAGE_SIZE);
+        page_size = KV_DEFAULT_PAGE_SIZE;
+    }
+    uint32_t magic = kv_file_magic(page_size, layout);
+    if(name == NULL){
+        return kv_open_memory(opts, magic);
+    }
+
+    int ret = kv_initialize(name, magic);
     if( ret != 0){
-        FATAL("initialize kv failed with errno: %d", ret)
+        FATAL("initialize kv failed with errno: %d", ret);
     }
 
     kv_file* kv = (kv_file*)malloc(sizeof(kv_file));
@@ -45,20 +106,124 @@ kv_file* kv_open(const char* name){
     FILE *f = fopen(name, "rb+");
 #endif
     if(f == NULL){
-        FATAL("open kv failed with errno: %d", errno)
+        FATAL("open kv failed with errno: %d", errno);
     }
 
-    if (fread(kv, offsetof(kv_file, cache), 1, f) <= 0){
-        FATAL("read kv header failed with errno: %d", errno)
+    if (fread(&kv->header, KV_FILE_HEADER_SIZE, 1, f) <= 0){
+        FATAL("read kv header failed with errno: %d", errno);
+    }
+    if(kv_magic_page_size(kv->header.magic) == 0){
+        FATAL("invalid kv file %s with magic %x", name, kv->header.magic);
+    }
+    kv_file_init(kv, f, name, opts);
+    kv_catalog_load(kv);
+    if(opts->warm_cache){
+        kv_warm_load(kv);
     }
-    kv->f = f;
-    kv->cache = cache_create(kv->page_num, 1024, f, offsetof(kv_file, cache));
     kv_set_signal_handler(kv);
 
     return kv;
 }
 
-int kv_initialize(const char* name){
+// runtime state shared by file and memory databases, the header is already set
+void kv_file_init(kv_file* kv, FILE* f, const char* name, const kv_options* opts){
+    kv->f = f;
+    kv->name = name != NULL ? strdup(name) : NULL;
+    memset(&kv->stats, 0, sizeof(kv->stats));
+    kv->pinned     = NULL;
+    kv->pinned_num = 0;
+    kv->pinned_cap = 0;
+    kv->lazy_delete = opts->lazy_delete;
+    kv->warm_cache  = opts->warm_cache;
+    kv->pending     = NULL;
+    kv->pending_num = 0;
+    kv->pending_cap = 0;
+    kv->main.kv     = kv;
+    kv->main.root   = kv->header.root;
+    kv->main.name[0]= 0;
+    kv->main.hint.page = NULL_PAGE;
+    kv->tree_version   = 0;
+    kv->tree_num    = 0;
+    kv->backup      = NULL;
+    kv->page_hwm    = kv->header.page_num;
+    kv->page_size   = kv_magic_page_size(kv->header.magic);
+    kv->layout      = kv_magic_layout(kv->header.magic);
+    kv->order       = KV_PAGE_ORDER(kv->page_size, kv->layout->record_size);
+    kv->min_records = KV_PAGE_MIN_RECORDS(kv->order);
+    kv->buf         = (uint8_t*)malloc(kv->page_size);
+    kv->cache = cache_create(kv->header.page_num, opts->cache_pages, kv->page_size, f, KV_FILE_HEADER_SIZE);
+}
+
+// no file behind the database, pages come from the cache arena and are never written
+kv_file* kv_open_memory(const kv_options* opts, uint32_t magic){
+    kv_file* kv  = (kv_file*)malloc(sizeof(kv_file));
+    kv->header.magic    = magic;
+    kv->header.root     = NULL_PAGE;
+    kv->header.free     = NULL_PAGE;
+    kv->header.page_num = 0;
+    kv_file_init(kv, NULL, NULL, opts);
+    return kv;
+}
+
+// the layout for the key and value widths of opts, NULL if there is none
+const kv_layout* kv_options_layout(const kv_options* opts){
+    const kv_layout* layouts[] = {&kv_layout_k64v64, &kv_layout_k32v32, &kv_layout_k64v32, &kv_layout_k32v64};
+    for(uint16_t i=0; i<sizeof(layouts) / sizeof(layouts[0]); ++i){
+        if(layouts[i]->key_bits == opts->key_bits && layouts[i]->value_bits == opts->value_bits){
+            return layouts[i];
+        }
+    }
+    return NULL;
+}
+
+// 4k files of 64 bit keys and values keep the old magic so that builds before
+// sized pages still open them
+uint32_t kv_file_magic(uint32_t page_size, const kv_layout* layout){
+    if(page_size < KV_PAGE_SIZE_MIN || page_size > KV_PAGE_SIZE_MAX || (page_size & (page_size - 1)) != 0){
+        return 0;
+    }
+    if(page_size == KV_PAGE_SIZE_MIN && layout->id == KV_LAYOUT_K64V64){
+        return KV_MAGIC;
+    }
+    return KV_MAGIC_SIZED | (uint32_t)layout->id << 8 | (uint32_t)__builtin_ctz(page_size);
+}
+
+// record layout of a file by its magic, NULL if the magic is unknown
+const kv_layout* kv_magic_layout(uint32_t magic){
+    if(magic == KV_MAGIC){
+        return &kv_layout_k64v64;
+    }
+    if((magic & 0xffff0000u) != KV_MAGIC_SIZED){
+        return NULL;
+    }
+    switch((magic >> 8) & 0xff){
+        case KV_LAYOUT_K64V64:
+            return &kv_layout_k64v64;
+        case KV_LAYOUT_K32V32:
+            return &kv_layout_k32v32;
+        case KV_LAYOUT_K64V32:
+            return &kv_layout_k64v32;
+        case KV_LAYOUT_K32V64:
+            return &kv_layout_k32v64;
+        default:
+            return NULL;
+    }
+}
+
+// page size of a file by its magic, 0 if the magic is unknown
+uint32_t kv_magic_page_size(uint32_t magic){
+    if(magic == KV_MAGIC){
+        return KV_PAGE_SIZE_MIN;
+    }
+    const kv_layout* layout = kv_magic_layout(magic);
+    if(layout == NULL || (magic & 0xff) >= 32){
+        return 0;
+    }
+    uint32_t page_size = 1u << (magic & 0xff);
+    return kv_file_magic(page_size, layout) == magic ? page_size : 0;
+}
+
+int kv_initialize(const char* name, uint32_t magic){
     if(!access(name, 0)){
         return 0;
     }
@@ -71,8 +236,8 @@ int kv_initialize(const char* name){
         return errno;
     }
 
-    kv_file kv = {.magic = KV_MAGIC, .root = NULL_PAGE, .free=NULL_PAGE, .page_num=0};
-    if(fwrite(&kv, offsetof(struct __kv_file, cache), 1, f) <= 0){
+    kv_file_header header = {.magic = magic, .root = NULL_PAGE, .free=NULL_PAGE, .page_num=0};
+    if(fwrite(&header, KV_FILE_HEADER_SIZE, 1, f) <= 0){
         return errno;
     }
     if(fclose(f) != 0){
@@ -85,570 +250,564 @@ int kv_close(kv_file* kv){
     if(kv == NULL){
         return CODE_INVALID_PARAMETER;
     }
-    kv_dirty_flush(kv, true);
-    fclose(kv->f);
+    if(kv->backup != NULL){
+        kv_backup_end(kv->backup);
+    }
+    kv_maintain(kv);
+    if(kv->f != NULL && kv->warm_cache){
+        kv_warm_save(kv);
+    }
+    if(kv->f != NULL){
+        kv_dirty_flush(kv, true);
+        fclose(kv->f);
+    }
+    if(_kv_for_signal == kv){
+        _kv_for_signal = NULL;
+    }
+    cache_destroy(kv->cache);
+    free(kv->pinned);
+    free(kv->pending);
+    for(uint16_t i=0; i<kv->tree_num; ++i){
+        free(kv->trees[i]);
+    }
+    free(kv->name);
+    free(kv->buf);
+    free(kv);
     return 0;
 }
 
-int kv_put(kv_file* kv, int64_t key, int64_t value){
-    if(kv->root == NULL_PAGE){
-        kv_page *new = kv_page_create(kv, KV_PAGE_DATA);
-        kv->root = new->page;
+// remember which pages are cached so the next open can prefetch them, only when
+// warm_cache is on so a short run without it keeps the list. the list is written
+// aside and renamed over the old one, a crash leaves either of them whole
+void kv_warm_save(kv_file* kv){
+    kv_cache_stats cs;
+    cache_get_stats(kv->cache, &cs);
+    uint32_t  max   = cs.cache_pages + cs.node_pages;
+    uint32_t* pages = (uint32_t*)malloc(sizeof(uint32_t) * (max + 2));
+    uint32_t  num   = cache_resident_pages(kv->cache, pages + 2, max);
+    pages[0] = KV_WARM_MAGIC;
+    pages[1] = num;
+
+    char path[strlen(kv->name) + sizeof(KV_WARM_SUFFIX)];
+    char tmp[strlen(kv->name) + sizeof(KV_WARM_SUFFIX) + sizeof(KV_WARM_TMP_SUFFIX)];
+    sprintf(path, "%s%s", kv->name, KV_WARM_SUFFIX);
+    sprintf(tmp, "%s%s", path, KV_WARM_TMP_SUFFIX);
+    FILE* f = fopen(tmp, "wb");
+    bool  ok = f != NULL && fwrite(pages, sizeof(uint32_t), num + 2, f) == num + 2;
+    if(f != NULL && fclose(f) != 0){
+        ok = false;
     }
+    if(!ok || rename(tmp, path) != 0){
+        WARN("save cache warm list %s failed with errno: %d", path, errno);
+        unlink(tmp);
+    }
+    free(pages);
+}
 
-    kv_page* leaf = kv_find_leaf_page(kv, kv_page_at(kv, kv->root), key);
-    kv_page_set(kv, leaf, key, value);
-    kv_page_split_if_need(kv, leaf);
-
-    // flush dirty
-    kv_dirty_flush(kv, false);
-    return 0;
+int kv_warm_compare(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
 }
 
-int kv_del(kv_file* kv, int64_t key){
-    if(kv->root == NULL_PAGE){
-        return 0;
+void kv_warm_load(kv_file* kv){
+    char path[strlen(kv->name) + sizeof(KV_WARM_SUFFIX)];
+    sprintf(path, "%s%s", kv->name, KV_WARM_SUFFIX);
+    FILE* f = fopen(path, "rb");
+    if(f == NULL){
+        return;
     }
-    kv_page* leaf = kv_find_leaf_page(kv, kv_page_at(kv, kv->root), key);
-    kv_page_del(kv, leaf, key);
-    kv_page_merge_if_need(kv, leaf);
 
-    //
-    kv_dirty_flush(kv, false);
-    return 0;
+    kv_cache_stats cs;
+    cache_get_stats(kv->cache, &cs);
+    uint32_t head[2] = {0};
+    if(fread(head, sizeof(uint32_t), 2, f) != 2 || head[0] != KV_WARM_MAGIC){
+        WARN("invalid cache warm list %s", path);
+        fclose(f);
+        return;
+    }
+
+    // the list is ordered by priority, keep what fits and read it in file order
+    uint32_t  num   = head[1] < cs.cache_pages ? head[1] : cs.cache_pages;
+    uint32_t* pages = (uint32_t*)malloc(sizeof(uint32_t) * (num + 1));
+    num = fread(pages, sizeof(uint32_t), num, f);
+    fclose(f);
+
+    qsort(pages, num, sizeof(uint32_t), kv_warm_compare);
+    uint32_t loaded = cache_prefetch(kv->cache, pages, num);
+    INFO("prefetch %u of %u cached pages", loaded, num);
+    free(pages);
 }
 
-int kv_get(kv_file* kv, int64_t key, int64_t* value){
-    if(kv->root == NULL_PAGE){
-        return CODE_KEY_NOT_EXIST;
+// roots of the main tree and of all named trees that are not empty, terminated by NULL_PAGE
+uint32_t* kv_tree_roots(kv_file* kv){
+    uint32_t* roots = (uint32_t*)malloc(sizeof(uint32_t) * (kv->tree_num + 2));
+    uint32_t  num   = 0;
+    if(kv->main.root != NULL_PAGE){
+        roots[num++] = kv->main.root;
     }
-
-    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, kv->root), key);
-    uint16_t index = kv_page_find_insert_index(leaf, key);
-    kv_record* records = KV_PAGE_RECORDS(leaf);
-    if(index >= leaf->record_num || records[index].key != key){
-        return CODE_KEY_NOT_EXIST;
+    for(uint16_t i=0; i<kv->tree_num; ++i){
+        if(kv->trees[i]->root != NULL_PAGE){
+            roots[num++] = kv->trees[i]->root;
+        }
     }
-    *value = records[index+1].value;
-    return 0;
+    roots[num] = NULL_PAGE;
+    return roots;
 }
 
-int kv_next(kv_file* kv, int64_t sk, int64_t* key, int64_t* value){
-    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, kv->root), sk);
-    uint16_t index = kv_page_find_insert_index(leaf, sk);
-    kv_record* records = KV_PAGE_RECORDS(leaf);
-
-    if(index < leaf->record_num && records[index].key == sk){
-        ++index;
+void kv_catalog_load(kv_file* kv){
+    if(kv->f == NULL || kv->header.page_num <= KV_CATALOG_PAGE){
+        return;
     }
 
-    if(index >= leaf->record_num && leaf->next_page == NULL_PAGE){
-        return CODE_KEY_NOT_EXIST;
-    }else if(index >= leaf->record_num && leaf->next_page != NULL_PAGE){
-        leaf = kv_page_at(kv, leaf->next_page);
-        index = 0;
+    kv_page* p = (kv_page*)kv->buf;
+    fseek(kv->f, KV_FILE_HEADER_SIZE + (size_t)kv->page_size * KV_CATALOG_PAGE, SEEK_SET);
+    if(fread(p, kv->page_size, 1, kv->f) <= 0){
+        FATAL("read catalog failed with errno: %d", errno);
+    }
+    // files written before named trees keep page 0 zeroed, files written before
+    // the high-water mark have all their pages in the tree or the free list
+    if(p->type != KV_PAGE_META){
+        return;
+    }
+    kv_meta* meta = KV_PAGE_META_TAIL(p, kv->page_size);
+    if(meta->magic == KV_META_MAGIC && meta->page_hwm <= kv->header.page_num){
+        kv->page_hwm = meta->page_hwm;
     }
 
-    records = KV_PAGE_RECORDS(leaf);
-    *key   = records[index].key;
-    *value = records[index+1].value;
-    return 0;
+    kv_catalog_entry* entries = (kv_catalog_entry*)KV_PAGE_RECORDS(p);
+    for(uint16_t i=0; i<p->record_num && i<KV_TREE_MAX; ++i){
+        kv_tree* t = (kv_tree*)malloc(sizeof(kv_tree));
+        t->kv   = kv;
+        t->root = entries[i].root;
+        t->hint.page = NULL_PAGE;
+        memcpy(t->name, entries[i].name, KV_TREE_NAME_SIZE);
+        t->name[KV_TREE_NAME_SIZE-1] = 0;
+        kv->trees[kv->tree_num++] = t;
+    }
 }
 
-void kv_range(kv_file* kv, int64_t min, int64_t max, void* ptr, void (*callback)(void*, int64_t, int64_t)){
-    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, kv->root), min);
-    uint16_t index = kv_page_find_insert_index(leaf, min);
-    kv_record* records = KV_PAGE_RECORDS(leaf);
-    if(index >= leaf->record_num){
+// written with the header since any flush may follow a root change or allocation
+void kv_catalog_save(kv_file* kv){
+    if(kv->f == NULL || kv->header.page_num <= KV_CATALOG_PAGE){
         return;
     }
 
-    for(;;){
-        if(records[index].key >= max){
-            break;
-        }
-        callback(ptr, records[index].key, records[index+1].value);
-        ++index;
-        if(index >= leaf->record_num){
-            if(leaf->next_page == NULL_PAGE){
-                break;
-            }
-            leaf = kv_page_at(kv, leaf->next_page);
-            index = 0;
-        }
+    kv_page* p = (kv_page*)kv->buf;
+    memset(p, 0, kv->page_size);
+    p->page       = KV_CATALOG_PAGE;
+    p->parent     = NULL_PAGE;
+    p->next_page  = NULL_PAGE;
+    p->type       = KV_PAGE_META;
+    p->record_num = kv->tree_num;
+    kv_catalog_entry* entries = (kv_catalog_entry*)KV_PAGE_RECORDS(p);
+    for(uint16_t i=0; i<kv->tree_num; ++i){
+        memcpy(entries[i].name, kv->trees[i]->name, KV_TREE_NAME_SIZE);
+        entries[i].root = kv->trees[i]->root;
+    }
+    kv_meta* meta  = KV_PAGE_META_TAIL(p, kv->page_size);
+    meta->page_hwm = kv->page_hwm;
+    meta->magic    = KV_META_MAGIC;
+
+    if(kv->backup != NULL){
+        kv_backup_preserve(kv->backup, KV_CATALOG_PAGE);
+    }
+    fseek(kv->f, KV_FILE_HEADER_SIZE + (size_t)kv->page_size * KV_CATALOG_PAGE, SEEK_SET);
+    if(fwrite(p, kv->page_size, 1, kv->f) <= 0){
+        FATAL("write catalog errno: %d", errno);
     }
 }
 
-void kv_iterate(kv_file*kv, void* ptr, void(*f)(void*, uint16_t, int64_t, int64_t)){
-    if(kv->root == NULL_PAGE){
-        return;
+kv_tree* kv_tree_open(kv_file* kv, const char* name){
+    if(kv == NULL){
+        return NULL;
     }
-    kv_record *records;
-    kv_page* p = kv_page_at(kv, kv->root);
-    for(; p->type != KV_PAGE_DATA;){
-        records = KV_PAGE_RECORDS(p);
-        p = kv_page_at(kv, records[0].value);
+    if(name == NULL || name[0] == 0){
+        return &kv->main;
+    }
+    if(strlen(name) >= KV_TREE_NAME_SIZE){
+        return NULL;
     }
 
-    uint32_t page = p->page;
-    for(; page != NULL_PAGE;){
-        p = kv_page_at(kv, page);
-        records = KV_PAGE_RECORDS(p);
-        for(uint16_t i=0; i<p->record_num; ++i){
-            f(ptr, page, records[i].key, records[i+1].value);
+    for(uint16_t i=0; i<kv->tree_num; ++i){
+        if(strcmp(kv->trees[i]->name, name) == 0){
+            return kv->trees[i];
         }
-        page = p->next_page;
     }
+    if(kv->tree_num >= KV_TREE_MAX){
+        return NULL;
+    }
+
+    // page 0 holds the catalog, so the file needs its first pages
+    if(kv->header.page_num <= KV_CATALOG_PAGE){
+        kv_extend_file(kv, kv_extend_pages(kv));
+    }
+    kv_tree* t = (kv_tree*)calloc(1, sizeof(kv_tree));
+    t->kv   = kv;
+    t->root = NULL_PAGE;
+    t->hint.page = NULL_PAGE;
+    strcpy(t->name, name);
+    kv->trees[kv->tree_num++] = t;
+    return t;
 }
 
-void kv_page_set(kv_file*kv, kv_page* p, int64_t key, int64_t value){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t index = kv_page_find_insert_index(p, key);
+int kv_put(kv_file* kv, int64_t key, int64_t value){
+    return kv_tree_put(&kv->main, key, value);
+}
 
-    if(index >= p->record_num || records[index].key != key){
-        for(uint16_t i=p->record_num; i>index; --i){
-            records[i].key = records[i-1].key;
-            records[i+1].value = records[i].value;
-        }
-        records[index].key   = key;
-        records[index+1].value = value;
-        p->record_num += 1;
-    }else if(records[index].key == key){
-        if(records[index+1].value == value){
-            return;
-        }
-        records[index+1].value = value;
+int kv_tree_put(kv_tree* t, int64_t key, int64_t value){
+    return t->kv->layout->put(t, key, value);
+}
+
+int kv_update(kv_file* kv, int64_t key, kv_update_fn fn, void* ctx){
+    return kv_tree_update(&kv->main, key, fn, ctx);
+}
+
+int kv_tree_update(kv_tree* t, int64_t key, kv_update_fn fn, void* ctx){
+    if(t == NULL || fn == NULL){
+        return CODE_INVALID_PARAMETER;
     }
-    kv_dirty_page(kv, p->page);
+    return t->kv->layout->update(t, key, fn, ctx);
 }
 
-kv_page* kv_split_page(kv_file* kv, kv_page* p){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t mid = KV_ORDER / 2;
-    int64_t  mid_key = records[mid].key;
-    kv_page* new = kv_page_create(kv, p->type);
-    kv_record* new_records = KV_PAGE_RECORDS(new);
-    kv_page* parent = NULL;
-    if(p->parent != NULL_PAGE){
-        parent = kv_page_at(kv, p->parent);
-        kv_record* parent_records = KV_PAGE_RECORDS(parent);
-        uint16_t index = kv_find_child_index(parent, records[0].key);
-        for(uint16_t i=parent->record_num; i>index; --i){
-            parent_records[i].key = parent_records[i-1].key;
-            parent_records[i+1].value = parent_records[i].value;
-        }
+typedef struct __kv_incr_ctx{
+    int64_t delta;
+    int64_t value;
+}kv_incr_ctx;
 
-        parent_records[index].key   = mid_key;
-        parent_records[index+1].value = new->page;
-        new->parent = parent->page;
-        parent->record_num += 1;
-    }else{
-        parent = kv_page_create(kv, KV_PAGE_NODE);
-        kv_record* parent_records = KV_PAGE_RECORDS(parent);
-        uint16_t index = 0;
-        parent_records[index].key = mid_key;
-        parent_records[index+1].value = new->page;
-        new->parent = parent->page;
-        parent->record_num += 1;
+bool kv_incr_fn(void* ctx, int64_t key, bool exists, int64_t* value){
+    kv_incr_ctx* c = (kv_incr_ctx*)ctx;
+    *value  += c->delta;
+    c->value = *value;
+    return true;
+}
 
-        parent_records[index].value = p->page;
-        p->parent = parent->page;
+int kv_incr(kv_file* kv, int64_t key, int64_t delta, int64_t* value){
+    return kv_tree_incr(&kv->main, key, delta, value);
+}
+
+// a missing key counts as 0, value gets the new value when not NULL
+int kv_tree_incr(kv_tree* t, int64_t key, int64_t delta, int64_t* value){
+    kv_incr_ctx ctx = {.delta = delta, .value = 0};
+    int ret = kv_tree_update(t, key, kv_incr_fn, &ctx);
+    if(ret == CODE_SUCCEED && value != NULL){
+        *value = ctx.value;
     }
+    return ret;
+}
 
-    if(p->type == KV_PAGE_DATA){
-        for(uint16_t i=mid; i<p->record_num; ++i){
-            new_records[i-mid].key = records[i].key;
-            new_records[i-mid+1].value = records[i+1].value;
-        }
-        new->record_num = p->record_num - mid;
-        p->record_num = mid;
-        new->next_page= p->next_page;
-        p->next_page = new->page;
-    }else{
-        for(uint16_t i=mid+1; i<p->record_num+1; ++i){
-            new_records[i-mid-1].key   = records[i].key;
-            new_records[i-mid-1].value = records[i].value;
-            kv_page* child = kv_page_at(kv, records[i].value);
-            child->parent = new->page;
-        }
-        new->record_num = p->record_num - mid - 1;
-        p->record_num = mid;
+typedef struct __kv_cas_ctx{
+    int64_t expected;
+    int64_t desired;
+    int     ret;
+}kv_cas_ctx;
+
+bool kv_cas_fn(void* ctx, int64_t key, bool exists, int64_t* value){
+    kv_cas_ctx* c = (kv_cas_ctx*)ctx;
+    if(!exists){
+        c->ret = CODE_KEY_NOT_EXIST;
+        return false;
+    }
+    if(*value != c->expected){
+        c->ret = CODE_VALUE_MISMATCH;
+        return false;
     }
+    *value = c->desired;
+    return true;
+}
 
-    kv_dirty_page(kv, p->page);
-    kv_dirty_page(kv, new->page);
-    kv_dirty_page(kv, parent->page);
-    return parent;
+int kv_cas(kv_file* kv, int64_t key, int64_t expected, int64_t desired){
+    return kv_tree_cas(&kv->main, key, expected, desired);
 }
 
-void kv_page_split_if_need(kv_file* kv, kv_page* p){
-    if(p->record_num < KV_ORDER) {
-        return;
-    }
+// set key to desired only if it holds expected, CODE_VALUE_MISMATCH otherwise
+int kv_tree_cas(kv_tree* t, int64_t key, int64_t expected, int64_t desired){
+    kv_cas_ctx ctx = {.expected = expected, .desired = desired, .ret = CODE_SUCCEED};
+    int ret = kv_tree_update(t, key, kv_cas_fn, &ctx);
+    return ret != CODE_SUCCEED ? ret : ctx.ret;
+}
 
-    bool root = (p->parent == NULL_PAGE);
-    kv_page* parent = kv_split_page(kv, p);
-    if(root){
-        kv->root = parent->page;
-    }
-    kv_page_split_if_need(kv, parent);
+int kv_del(kv_file* kv, int64_t key){
+    return kv_tree_del(&kv->main, key);
+}
+
+int kv_tree_del(kv_tree* t, int64_t key){
+    return t->kv->layout->del(t, key);
 }
 
-uint16_t kv_page_find_insert_index(kv_page* p, int64_t key){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    if(p->record_num <= 0 || records[p->record_num-1].key < key){
-        return p->record_num;
+int kv_apply_batch(kv_file* kv, kv_op* ops, uint32_t num){
+    if(kv == NULL){
+        return CODE_INVALID_PARAMETER;
     }
+    return kv_tree_apply_batch(&kv->main, ops, num);
+}
 
-    uint16_t left = 0, right = p->record_num -1;
-    for(; left < right; ){
-        uint16_t mid = (left + right) / 2;
-        if(records[mid].key < key){
-            left = mid + 1;
-        }else{
-            right = mid;
-        }
+int kv_tree_apply_batch(kv_tree* t, kv_op* ops, uint32_t num){
+    if(t == NULL || (ops == NULL && num > 0)){
+        return CODE_INVALID_PARAMETER;
     }
-    return left;
-}
-
-void kv_extend_file(kv_file* kv, uint16_t num){
-    fseek(kv->f, 0, SEEK_END);
-    kv_page *p = (kv_page*)kv->buf;
-    for(uint16_t i=0; i<num; ++i){
-        p->page      = kv->page_num + i;
-        p->parent    = NULL_PAGE;
-        p->type      = 0;
-        p->record_num=0;
-        if(i == num-1){
-            p->next_page = kv->free;
-        }else{
-            p->next_page = p->page + 1;
-        }
+    return t->kv->layout->apply_batch(t, ops, num);
+}
 
-        if(fwrite(p, KV_PAGE_SIZE, 1, kv->f) <= 0){
-            FATAL("extend kv file errno: %d", errno)
-        }
+int kv_flush(kv_file* kv){
+    if(kv == NULL){
+        return CODE_INVALID_PARAMETER;
     }
+    kv_dirty_flush(kv, true);
+    return CODE_SUCCEED;
+}
 
-    if(kv->page_num <= 0){
-        kv->free = 1;
-    }else{
-        kv->free = kv->page_num;
+int kv_del_range(kv_file* kv, int64_t min, int64_t max){
+    if(kv == NULL){
+        return CODE_INVALID_PARAMETER;
     }
-    kv->page_num += num;
-    cache_set_page_num(kv->cache, kv->page_num);
+    return kv_tree_del_range(&kv->main, min, max);
 }
 
-kv_page* kv_page_create(kv_file* kv, uint16_t type){
-    if(kv->free == NULL_PAGE){
-        kv_extend_file(kv, 1024);
+int kv_tree_del_range(kv_tree* t, int64_t min, int64_t max){
+    if(t == NULL || min >= max){
+        return CODE_INVALID_PARAMETER;
     }
+    return t->kv->layout->del_range(t, min, max);
+}
 
-    kv_page *p = (kv_page*)cache_get_page(kv->cache, kv->free);
-    kv->free      = p->next_page;
-    p->parent     = NULL_PAGE;
-    p->type       = type;
-    p->next_page  = NULL_PAGE;
-    p->record_num = 0;
+int kv_get(kv_file* kv, int64_t key, int64_t* value){
+    return kv_tree_get(&kv->main, key, value);
+}
 
-    if(p->page == NULL_PAGE){
-        FATAL("INVALID PAGE")
-    }
+int kv_tree_get(kv_tree* t, int64_t key, int64_t* value){
+    return t->kv->layout->get(t, key, value);
+}
 
-    //INFO("create page %d", p->page)
+int kv_next(kv_file* kv, int64_t sk, int64_t* key, int64_t* value){
+    return kv_tree_next(&kv->main, sk, key, value);
+}
 
-    return p;
+int kv_tree_next(kv_tree* t, int64_t sk, int64_t* key, int64_t* value){
+    return t->kv->layout->next(t, sk, key, value);
 }
 
-kv_page* kv_page_at(kv_file* kv, uint32_t page){
-    return cache_get_page(kv->cache, page);
+void kv_range(kv_file* kv, int64_t min, int64_t max, void* ptr, void (*callback)(void*, int64_t, int64_t)){
+    kv_tree_range(&kv->main, min, max, ptr, callback);
+}
+
+void kv_tree_range(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, int64_t, int64_t)){
+    t->kv->layout->range(t, min, max, ptr, callback);
 }
 
-uint16_t kv_recursive_find_child_index(kv_page* p, uint16_t left, uint16_t right, int64_t key){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t mid = (left + right) / 2;
+void kv_iterate(kv_file*kv, void* ptr, void(*f)(void*, uint16_t, int64_t, int64_t)){
+    kv_tree_iterate(&kv->main, ptr, f);
+}
 
-    if(right - left <= 1){
-        return left + 1;
-    }
+void kv_tree_iterate(kv_tree* t, void* ptr, void(*f)(void*, uint16_t, int64_t, int64_t)){
+    t->kv->layout->iterate(t, ptr, f);
+}
 
-    if(records[mid].key > key){
-        return kv_recursive_find_child_index(p, left, mid, key);
-    }else{
-        return kv_recursive_find_child_index(p, mid, right, key);
+uint32_t kv_maintain(kv_file* kv){
+    if(kv == NULL || kv->pending_num == 0){
+        return 0;
     }
+    return kv->layout->maintain(kv);
 }
 
-uint16_t kv_find_child_index(kv_page* p, int64_t key){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    if(records[p->record_num-1].key <= key){
-        return p->record_num;
-    }else if(records[0].key > key){
+int kv_parallel_iterate(kv_file* kv, uint16_t nthreads, void** ptrs, void(*f)(void*, uint16_t, int64_t, int64_t)){
+    if(kv->main.root == NULL_PAGE || nthreads == 0){
         return 0;
     }
-    return kv_recursive_find_child_index(p, 0, p->record_num-1, key);
-}
 
-kv_page* kv_find_leaf_page(kv_file* kv, kv_page* p, int64_t key){
-    if(p->type == KV_PAGE_DATA){
-        return p;
-    }
-
-    // find child
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t index = kv_find_child_index(p, key);
-    kv_page* child = kv_page_at(kv, records[index].value);
-    return kv_find_leaf_page(kv, child, key);
-}
-
-void kv_page_replace_min(kv_file* kv, kv_page* p, int64_t key){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    int64_t  min = records[0].key;
-    uint32_t parent_page = p->parent;
-    for( ;parent_page != NULL_PAGE; ){
-        kv_page* parent = kv_page_at(kv, parent_page);
-        kv_record* parent_records = KV_PAGE_RECORDS(parent);
-        uint16_t index = kv_find_child_index(parent, key);
-        if(index != 0 && parent_records[index-1].key == key){
-            parent_records[index-1].key = min;
-            kv_dirty_page(kv, parent->page);
+    // workers read the file directly, so everything cached must be on disk
+    if(kv->f == NULL){
+        kv_tree_iterate(&kv->main, ptrs[0], f);
+        return 1;
+    }
+    kv_dirty_flush(kv, true);
+
+    // go down until a level has enough subtrees to balance the workers
+    uint32_t  num   = 1;
+    uint32_t* level = (uint32_t*)malloc(sizeof(uint32_t));
+    level[0] = kv->main.root;
+    for(; num < (uint32_t)nthreads * 4;){
+        if(kv_page_at(kv, level[0])->type == KV_PAGE_DATA){
+            break;
         }
-        parent_page = parent->parent;
+        level = kv->layout->expand_level(kv, level, num, &num);
     }
-}
 
-void kv_page_del(kv_file* kv, kv_page* p, int64_t key){
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t   index = kv_page_find_insert_index(p, key);
-    if(index >= p->record_num || records[index].key != key){
-        return;
+    uint16_t parts = num < nthreads ? num : nthreads;
+    scan_range* ranges = (scan_range*)malloc(sizeof(scan_range) * parts);
+    for(uint16_t i=0; i<parts; ++i){
+        ranges[i].first = kv->layout->leftmost_leaf(kv, level[(uint64_t)i * num / parts])->page;
+        ranges[i].ptr   = ptrs[i];
     }
+    for(uint16_t i=0; i<parts; ++i){
+        ranges[i].stop = i + 1 < parts ? ranges[i+1].first : NULL_PAGE;
+    }
+    free(level);
+
+    scan_leaf_ranges(fileno(kv->f), KV_FILE_HEADER_SIZE, kv->page_size, kv->layout->unpack, ranges, parts, f);
+    free(ranges);
+    return parts;
+}
 
-    for(uint16_t i=index; i<p->record_num-1; ++i){
-        records[i].key = records[i+1].key;
-        records[i+1].value = records[i+2].value;
+int kv_check(kv_file* kv, uint16_t nthreads, kv_check_result* result){
+    if(kv == NULL || kv->f == NULL || result == NULL){
+        return CODE_INVALID_PARAMETER;
     }
-    p->record_num -= 1;
 
-    if(p->parent != NULL_PAGE && index == 0){
-        kv_page_replace_min(kv, p, key);
+    kv_dirty_flush(kv, true);
+    uint32_t* roots = kv_tree_roots(kv);
+    uint32_t  num   = 0;
+    for(; roots[num] != NULL_PAGE; ++num){
     }
-    kv_dirty_page(kv, p->page);
+    int ret = check_tree(fileno(kv->f), KV_FILE_HEADER_SIZE, kv->page_size, kv->order, kv->layout->unpack,
+                         roots, num, kv->header.free, kv->page_hwm, kv->header.page_num, nthreads, result);
+    free(roots);
+    return ret;
 }
 
-bool kv_page_should_get_record_from_left(kv_file*kv, kv_page* p){
-    kv_page*   parent = kv_page_at(kv, p->parent);
-    kv_record* parent_records = KV_PAGE_RECORDS(parent);
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t index  = kv_find_child_index(parent, records[0].key);
-    if(index > 0){
-        kv_page* sibling = kv_page_at(kv, parent_records[index-1].value);
-        return sibling->record_num > KV_MIN_RECORDS;
+int kv_range_aggregate(kv_file* kv, int64_t min, int64_t max, int ops, kv_aggregate* result){
+    if(kv == NULL){
+        return CODE_INVALID_PARAMETER;
     }
-    return false;
+    return kv_tree_range_aggregate(&kv->main, min, max, ops, result);
 }
 
-bool kv_page_should_get_record_from_right(kv_file*kv, kv_page* p){
-    kv_page*   parent = kv_page_at(kv, p->parent);
-    kv_record* parent_records = KV_PAGE_RECORDS(parent);
-    kv_record* records = KV_PAGE_RECORDS(p);
-    uint16_t index  = kv_find_child_index(parent, records[0].key);
-    if(index < parent->record_num){
-        kv_page* sibling = kv_page_at(kv, parent_records[index+1].value);
-        return sibling->record_num > KV_MIN_RECORDS;
+int kv_tree_range_aggregate(kv_tree* t, int64_t min, int64_t max, int ops, kv_aggregate* result){
+    if(t == NULL || result == NULL){
+        return CODE_INVALID_PARAMETER;
     }
-    return false;
+
+    memset(result, 0, sizeof(kv_aggregate));
+    result->ops = ops;
+    t->kv->layout->range_aggregate(t, min, max, result);
+    return CODE_SUCCEED;
 }
 
-void kv_page_get_record_from_left(kv_file* kv, kv_page* p){
-    kv_page*   parent = kv_page_at(kv, p->parent);
-    kv_record* parent_records = KV_PAGE_RECORDS(parent);
-    kv_record* records = KV_PAGE_RECORDS(p);
+void kv_range_spans(kv_file* kv, int64_t min, int64_t max, void* ptr, void (*callback)(void*, const kv_span*)){
+    kv_tree_range_spans(&kv->main, min, max, ptr, callback);
+}
 
-    for(uint16_t i=p->record_num; i>0; --i){
-        records[i].key     = records[i-1].key;
-        records[i+1].value = records[i].value;
-    }
-    p->record_num += 1;
+void kv_tree_range_spans(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, const kv_span*)){
+    t->kv->layout->range_spans(t, min, max, ptr, callback);
+}
 
-    uint16_t index  = kv_find_child_index(parent, records[0].key);
-    kv_page*   sibling = kv_page_at(kv, parent_records[index-1].value);
-    kv_record* sibling_records = KV_PAGE_RECORDS(sibling);
-    if(p->type == KV_PAGE_DATA){
-        records[0].key   = sibling_records[sibling->record_num-1].key;
-        records[0].value = sibling_records[sibling->record_num].value;
-        parent_records[index-1].key = records[0].key;
-    }else{
-        records[0].key = parent_records[index-1].key;
-        parent_records[index-1].key = sibling_records[sibling->record_num-1].key;
-        records[0].value = sibling_records[sibling->record_num].value;
-        sibling_records[sibling->record_num].value = NULL_PAGE;
-        kv_page* child = kv_page_at(kv, records[0].value);
-        child->parent  = p->page;
-    }
-    sibling->record_num -= 1;
+uint32_t kv_range_copy(kv_file* kv, int64_t min, int64_t max, kv_record* out, uint32_t num){
+    return kv_tree_range_copy(&kv->main, min, max, out, num);
+}
 
-    kv_dirty_page(kv, p->page);
-    kv_dirty_page(kv, sibling->page);
-    kv_dirty_page(kv, parent->page);
+uint32_t kv_tree_range_copy(kv_tree* t, int64_t min, int64_t max, kv_record* out, uint32_t num){
+    return t->kv->layout->range_copy(t, min, max, out, num);
 }
 
-void kv_page_get_record_from_right(kv_file* kv, kv_page* p){
-    kv_page*   parent = kv_page_at(kv, p->parent);
-    kv_record* parent_records = KV_PAGE_RECORDS(parent);
-    kv_record* records = KV_PAGE_RECORDS(p);
+void kv_page_set(kv_file* kv, kv_page* p, int64_t key, int64_t value){
+    kv->layout->page_set(kv, p, key, value);
+}
 
-    p->record_num += 1;
-    uint16_t index  = kv_find_child_index(parent, records[0].key);
-    kv_page*   sibling = kv_page_at(kv, parent_records[index+1].value);
-    kv_record* sibling_records = KV_PAGE_RECORDS(sibling);
-    if(p->type == KV_PAGE_DATA){
-        records[p->record_num-1].key = sibling_records[0].key;
-        records[p->record_num].value = sibling_records[1].value;
-        parent_records[index].key = sibling_records[1].key;
-    }else{
-        records[p->record_num-1].key = parent_records[index].key;
-        parent_records[index].key = sibling_records[0].key;
-        records[p->record_num].value = sibling_records[0].value;
-        kv_page* child = kv_page_at(kv, records[p->record_num].value);
-        child->parent  = p->page;
+// reserve num pages at the end of the file in one call, their content is never
+// read before kv_page_create hands them out in order from page_hwm
+void kv_extend_file(kv_file* kv, uint32_t num){
+    if(kv->f != NULL){
+        fflush(kv->f);
+        int   fd   = fileno(kv->f);
+        off_t from = KV_FILE_HEADER_SIZE + (off_t)kv->page_size * kv->header.page_num;
+        off_t len  = (off_t)kv->page_size * num;
+        // file systems without fallocate get a sparse file
+        if(posix_fallocate(fd, from, len) != 0 && ftruncate(fd, from + len) != 0){
+            FATAL("extend kv file errno: %d", errno);
+        }
     }
 
-    for(uint16_t i=1; i<sibling->record_num; ++i){
-        sibling_records[i-1].key   = sibling_records[i].key;
-        sibling_records[i-1].value = sibling_records[i].value;
+    if(kv->header.page_num <= KV_CATALOG_PAGE){
+        kv->page_hwm = KV_CATALOG_PAGE + 1;
     }
-    sibling_records[sibling->record_num-1].value = sibling_records[sibling->record_num].value;
-    sibling->record_num -= 1;
-
-    kv_dirty_page(kv, p->page);
-    kv_dirty_page(kv, sibling->page);
-    kv_dirty_page(kv, parent->page);
+    kv->header.page_num += num;
+    cache_set_page_num(kv->cache, kv->header.page_num);
+    kv->stats.file_extends += 1;
 }
 
-kv_page* kv_page_merge_sibling(kv_file* kv, kv_page* left, kv_page*right){
-    kv_page*   parent = kv_page_at(kv, left->parent);
-    kv_record* parent_records = KV_PAGE_RECORDS(parent);
-    kv_record* left_records   = KV_PAGE_RECORDS(left);
-    kv_record* right_records  = KV_PAGE_RECORDS(right);
-    uint16_t   index = kv_find_child_index(parent, left_records[0].key);
+uint32_t kv_extend_pages(kv_file* kv){
+    uint32_t scale = kv->page_size / KV_PAGE_SIZE_MIN;
+    uint32_t num   = kv->header.page_num / 2;
+    if(num < KV_EXTEND_MIN_PAGES / scale){
+        return KV_EXTEND_MIN_PAGES / scale;
+    }
+    return num > KV_EXTEND_MAX_PAGES / scale ? KV_EXTEND_MAX_PAGES / scale : num;
+}
 
-    if(left->type == KV_PAGE_DATA){
-        for(uint16_t i=0; i<right->record_num; ++i){
-            left_records[left->record_num+i].key = right_records[i].key;
-            left_records[left->record_num+i+1].value = right_records[i+1].value;
-        }
-        left->record_num += right->record_num;
-        left->next_page   = right->next_page;
+// reuse a freed page first, else take the next never used one without reading it
+kv_page* kv_page_create(kv_file* kv, uint16_t type){
+    uint32_t page;
+    if(kv->header.free != NULL_PAGE){
+        page            = kv->header.free;
+        kv->header.free = kv_page_at(kv, page)->next_page;
     }else{
-        left_records[left->record_num].key = parent_records[index].key;
-        left_records[left->record_num+1].value = right_records[0].value;
-        kv_page* child = kv_page_at(kv, right_records[0].value);
-        child->parent = left->page;
-        left->record_num += 1;
-        for(uint16_t i=0; i<right->record_num; ++i){
-            left_records[left->record_num+i].key = right_records[i].key;
-            left_records[left->record_num+i+1].value = right_records[i+1].value;
-            child = kv_page_at(kv, right_records[i+1].value);
-            child->parent = left->page;
+        if(kv->page_hwm >= kv->header.page_num){
+            kv_extend_file(kv, kv_extend_pages(kv));
         }
-        left->record_num += right->record_num;
+        page = kv->page_hwm;
+        cache_new_page(kv->cache, page)->page = page;
+        kv->page_hwm += 1;
     }
 
-    for(uint16_t i=index; i<parent->record_num-1; ++i){
-        parent_records[i].key     = parent_records[i+1].key;
-        parent_records[i+1].value = parent_records[i+2].value;
+    // internal nodes stay resident in the node pool of the cache, a reused page
+    // moves in or out of it here before anything points to it
+    cache_place_page(kv->cache, page, type == KV_PAGE_NODE);
+    kv_page *p    = kv_page_pin(kv, page);
+    p->parent     = NULL_PAGE;
+    p->type       = type;
+    p->next_page  = NULL_PAGE;
+    p->record_num = 0;
+    kv_dirty_page(kv, p->page);
+
+    if(p->page == NULL_PAGE){
+        FATAL("INVALID PAGE");
     }
-    parent->record_num -= 1;
 
-    kv_dirty_page(kv, left->page);
-    kv_dirty_page(kv, parent->page);
+    //INFO("create page %d", p->page)
 
-    // free right page
+    return p;
+}
 
-    return parent;
+// the returned page may be evicted by the next page access, use
+// kv_page_pin for pages held while other pages are loaded
+kv_page* kv_page_at(kv_file* kv, uint32_t page){
+    return cache_get_page(kv->cache, page);
 }
 
-void kv_page_merge_if_need(kv_file* kv, kv_page* p){
-    if(p->record_num >= KV_MIN_RECORDS){
-        return;
+// pin page until kv_unpin_all at the end of the current operation
+kv_page* kv_page_pin(kv_file* kv, uint32_t page){
+    if(kv->pinned_num >= kv->pinned_cap){
+        kv->pinned_cap = kv->pinned_cap > 0 ? kv->pinned_cap * 2 : 64;
+        kv->pinned = (uint32_t*)realloc(kv->pinned, sizeof(uint32_t) * kv->pinned_cap);
     }
+    kv->pinned[kv->pinned_num++] = page;
+    return cache_pin_page(kv->cache, page);
+}
 
-    kv_record* records = KV_PAGE_RECORDS(p);
-    if(p->parent == NULL_PAGE && p->record_num == 0){
-        kv->root = records[0].value;
-        if(kv->root != NULL_PAGE){
-            kv_page* root = kv_page_at(kv, kv->root);
-            root->parent = NULL_PAGE;
-        }
-        // free page p
-
-    }else if(p->parent != NULL_PAGE){
-        if(kv_page_should_get_record_from_left(kv, p)){
-            kv_page_get_record_from_left(kv, p);
-        }else if(kv_page_should_get_record_from_right(kv, p)){
-            kv_page_get_record_from_right(kv, p);
-        }else{
-            kv_page*   parent = kv_page_at(kv, p->parent);
-            kv_record* parent_records = KV_PAGE_RECORDS(parent);
-            uint16_t index  = kv_find_child_index(parent, records[0].key);
-            kv_page*   sibling = NULL;
-            if(index < parent->record_num){
-                sibling = kv_page_at(kv, parent_records[index+1].value);
-                parent = kv_page_merge_sibling(kv, p, sibling);
-            }else{
-                sibling = kv_page_at(kv, parent_records[index-1].value);
-                parent  = kv_page_merge_sibling(kv, sibling, p);
-            }
-            kv_page_merge_if_need(kv, parent);
-        }
+void kv_unpin_all(kv_file* kv){
+    for(uint32_t i=0; i<kv->pinned_num; ++i){
+        cache_unpin_page(kv->cache, kv->pinned[i]);
     }
+    kv->pinned_num = 0;
 }
 
-void kv_print_pages(kv_file* kv, kv_page** pages, uint16_t page_num, uint16_t level){
-    char fmt[16] = {0};
-    uint16_t begin = 60 - level * 10;
-    sprintf(fmt, "%%%ds", begin);
-    printf(fmt, " ");
-
-    kv_page* child[16] = {0};
-    uint16_t child_num = 0;
-
-    for(uint16_t n=0; n<page_num; ++n) {
-        kv_page* p = pages[n];
-        kv_record *records = KV_PAGE_RECORDS(p);
+void kv_page_set_parent(kv_file* kv, uint32_t page, uint32_t parent){
+    kv_page* child = kv_page_at(kv, page);
+    child->parent  = parent;
+    kv_dirty_page(kv, page);
+}
 
-        printf("    <%d>", p->page);
-        if (p->type == KV_PAGE_DATA) {
-            for (uint16_t i = 0; i < p->record_num; ++i) {
-                printf("(%ld)%ld", records[i].value, records[i].key);
-            }
-            printf("(%ld)", records[p->record_num].value);
-        } else {
-            for (uint16_t i = 0; i < p->record_num; ++i) {
-                printf("(%ld)%ld", records[i].value, records[i].key);
-                child[child_num] = kv_page_at(kv, records[i].value);
-                child_num += 1;
-            }
-            printf("(%ld)", records[p->record_num].value);
-            child[child_num] = kv_page_at(kv, records[p->record_num].value);
-            child_num += 1;
-        }
-    }
-    printf("\n");
-    if(child_num > 0){
-        kv_print_pages(kv, child, child_num, level+1);
-    }
+void kv_page_free(kv_file* kv, kv_page* p){
+    p->type         = 0;
+    p->parent       = NULL_PAGE;
+    p->record_num   = 0;
+    p->next_page    = kv->header.free;
+    kv->header.free = p->page;
+    kv->tree_version += 1;
+    kv_dirty_page(kv, p->page);
 }
 
 void kv_print(kv_file* kv){
-    if(kv->root == NULL_PAGE){
-        return;
-    }
-
-    kv_page* pages[1] = {kv_page_at(kv, kv->root)};
-    kv_print_pages(kv, pages, 1, 0);
+    kv->layout->print(kv);
 }
 
 void kv_dirty_page(kv_file* kv, uint32_t page){
@@ -660,10 +819,12 @@ void kv_dirty_flush(kv_file* kv, bool force){
         return;
     }
 
+    kv->header.root = kv->main.root;
     fseek(kv->f, 0, SEEK_SET);
-    if(fwrite(kv, offsetof(struct __kv_file, cache), 1, kv->f) <= 0){
-        FATAL("write kv header errno: %d", errno)
+    if(fwrite(&kv->header, KV_FILE_HEADER_SIZE, 1, kv->f) <= 0){
+        FATAL("write kv header errno: %d", errno);
     }
+    kv_catalog_save(kv);
     fflush(kv->f);
 }
 
@@ -683,13 +844,262 @@ void kv_set_signal_handler(kv_file* kv) {
 }
 
 int kv_clear(kv_file *kv) {
-    kv->free = NULL_PAGE;
-    kv->root = NULL_PAGE;
-    kv->page_num = 0;
+    // the truncated pages can't be saved any more, so copy what is left first
+    if(kv->backup != NULL){
+        kv_backup_step(kv->backup, UINT32_MAX, NULL);
+    }
+    kv->header.free = NULL_PAGE;
+    kv->header.root = NULL_PAGE;
+    kv->header.page_num = 0;
+    kv->page_hwm = 0;
+    kv->pending_num = 0;
+    kv->tree_version += 1;
+    kv->main.root = NULL_PAGE;
+    for(uint16_t i=0; i<kv->tree_num; ++i){
+        kv->trees[i]->root = NULL_PAGE;
+    }
+    if(kv->f == NULL){
+        cache_set_page_num(kv->cache, 0);
+        return 0;
+    }
     int fd = fileno(kv->f);
-    int ret = ftruncate(fd, offsetof(struct __kv_file, cache));
+    int ret = ftruncate(fd, KV_FILE_HEADER_SIZE);
     if(ret != 0){
         return errno;
     }
     return 0;
 }
+
+void kv_stats_fill(kv_stats* stats, kv_page* p, uint16_t order){
+    uint32_t bucket = (uint32_t)p->record_num * KV_STATS_FILL_BUCKETS / order;
+    if(bucket >= KV_STATS_FILL_BUCKETS){
+        bucket = KV_STATS_FILL_BUCKETS - 1;
+    }
+
+    if(p->type == KV_PAGE_DATA){
+        stats->leaf_pages += 1;
+        stats->leaf_fill[bucket] += 1;
+        stats->records += p->record_num;
+    }else{
+        stats->node_pages += 1;
+        stats->node_fill[bucket] += 1;
+    }
+}
+
+int kv_get_stats(kv_file* kv, kv_stats* stats){
+    if(kv == NULL || stats == NULL){
+        return CODE_INVALID_PARAMETER;
+    }
+
+    // snapshot cache counters before the tree walk below disturbs them
+    kv_cache_stats cs;
+    cache_get_stats(kv->cache, &cs);
+
+    *stats = kv->stats;
+    stats->cache_hits      = cs.hits;
+    stats->cache_misses    = cs.misses;
+    stats->cache_evictions = cs.evictions;
+    stats->dirty_evictions = cs.dirty_evictions;
+    stats->pages_read      = cs.pages_read;
+    stats->pages_written   = cs.pages_written;
+    stats->dirty_flushes   = cs.flushes;
+    stats->flush_usec      = cs.flush_usec;
+    stats->flush_usec_max  = cs.flush_usec_max;
+    stats->cache_pages     = cs.cache_pages;
+    stats->node_pool_pages = cs.node_pages;
+    stats->dirty_pages     = cs.dirty;
+    stats->page_num        = kv->header.page_num;
+    stats->page_size       = kv->page_size;
+    stats->key_bits        = kv->layout->key_bits;
+    stats->value_bits      = kv->layout->value_bits;
+
+    // walk all trees level by level, the height is the one of the tallest tree
+    uint32_t* level = kv_tree_roots(kv);
+    uint32_t  num   = 0;
+    for(; level[num] != NULL_PAGE; ++num){
+    }
+    for(; num > 0;){
+        stats->tree_height += 1;
+        for(uint32_t n=0; n<num; ++n){
+            kv_stats_fill(stats, kv_page_at(kv, level[n]), kv->order);
+        }
+        level = kv->layout->expand_level(kv, level, num, &num);
+    }
+    free(level);
+    return CODE_SUCCEED;
+}
+
+// write all of buf, retrying short writes to pipes and sockets
+int kv_write_full(int fd, const void* buf, size_t size){
+    const uint8_t* p = (const uint8_t*)buf;
+    for(; size > 0;){
+        ssize_t ret = write(fd, p, size);
+        if(ret < 0 && errno == EINTR){
+            continue;
+        }
+        if(ret <= 0){
+            return CODE_IO_ERROR;
+        }
+        p    += ret;
+        size -= ret;
+    }
+    return CODE_SUCCEED;
+}
+
+// read up to size bytes, less only at the end of the stream
+int kv_read_full(int fd, void* buf, size_t size, size_t* got){
+    uint8_t* p = (uint8_t*)buf;
+    *got = 0;
+    for(; *got < size;){
+        ssize_t ret = read(fd, p + *got, size - *got);
+        if(ret < 0 && errno == EINTR){
+            continue;
+        }
+        if(ret < 0){
+            return CODE_IO_ERROR;
+        }
+        if(ret == 0){
+            break;
+        }
+        *got += ret;
+    }
+    return CODE_SUCCEED;
+}
+
+kv_backup_job* kv_backup_begin(kv_file* kv, int fd){
+    if(kv == NULL || kv->f == NULL || fd < 0 || kv->backup != NULL){
+        return NULL;
+    }
+
+    // after a forced flush the file holds a consistent image, including the header
+    kv_dirty_flush(kv, true);
+    kv_backup_job* b = (kv_backup_job*)calloc(1, sizeof(kv_backup_job));
+    b->kv       = kv;
+    b->fd       = fd;
+    b->page_num = kv->header.page_num;
+    b->next     = 0;
+    b->saved    = (uint8_t**)calloc(kv->header.page_num + 1, sizeof(uint8_t*));
+    b->buf      = (uint8_t*)malloc((size_t)kv->page_size * KV_BACKUP_CHUNK);
+    b->error    = kv_write_full(fd, &kv->header, KV_FILE_HEADER_SIZE);
+    kv->backup  = b;
+    cache_set_write_hook(kv->cache, kv_backup_preserve, b);
+    return b;
+}
+
+// keep the image's copy of page before it is overwritten, unless it was copied already.
+// pages appended after the backup began are not part of the image
+void kv_backup_preserve(void* ptr, uint32_t page){
+    kv_backup_job* b = (kv_backup_job*)ptr;
+    if(page < b->next || page >= b->page_num || b->saved[page] != NULL){
+        return;
+    }
+
+    fflush(b->kv->f);
+    uint8_t* copy = (uint8_t*)malloc(b->kv->page_size);
+    if(!scan_pread_page(fileno(b->kv->f), KV_FILE_HEADER_SIZE, b->kv->page_size, page, (kv_page*)copy)){
+        FATAL("backup save page %u error: %d", page, errno);
+    }
+    b->saved[page] = copy;
+}
+
+// copy up to pages pages of the image in file order
+int kv_backup_step(kv_backup_job* b, uint32_t pages, uint32_t* left){
+    if(b == NULL){
+        return CODE_INVALID_PARAMETER;
+    }
+
+    kv_file* kv = b->kv;
+    fflush(kv->f);
+    for(; b->error == CODE_SUCCEED && b->next < b->page_num && pages > 0;){
+        uint32_t num = b->page_num - b->next;
+        num = num < KV_BACKUP_CHUNK ? num : KV_BACKUP_CHUNK;
+        num = num < pages ? num : pages;
+
+        size_t  size = (size_t)kv->page_size * num;
+        ssize_t ret  = pread(fileno(kv->f), b->buf, size, KV_FILE_HEADER_SIZE + (size_t)kv->page_size * b->next);
+        if(ret != (ssize_t)size){
+            b->error = CODE_IO_ERROR;
+            break;
+        }
+        for(uint32_t i=0; i<num; ++i){
+            uint8_t* copy = b->saved[b->next + i];
+            if(copy != NULL){
+                memcpy(b->buf + (size_t)kv->page_size * i, copy, kv->page_size);
+                free(copy);
+                b->saved[b->next + i] = NULL;
+            }
+        }
+        b->error = kv_write_full(b->fd, b->buf, size);
+        b->next += num;
+        pages   -= num;
+    }
+
+    if(left != NULL){
+        *left = b->page_num - b->next;
+    }
+    return b->error;
+}
+
+int kv_backup_end(kv_backup_job* b){
+    if(b == NULL){
+        return CODE_INVALID_PARAMETER;
+    }
+
+    int ret = kv_backup_step(b, UINT32_MAX, NULL);
+    cache_set_write_hook(b->kv->cache, NULL, NULL);
+    b->kv->backup = NULL;
+    for(uint32_t i=0; i<b->page_num; ++i){
+        free(b->saved[i]);
+    }
+    free(b->saved);
+    free(b->buf);
+    free(b);
+    return ret;
+}
+
+int kv_backup(kv_file* kv, int fd){
+    kv_backup_job* b = kv_backup_begin(kv, fd);
+    if(b == NULL){
+        return CODE_INVALID_PARAMETER;
+    }
+    return kv_backup_end(b);
+}
+
+int kv_dump(kv_file* kv, int fd){
+    return kv_tree_dump(&kv->main, fd);
+}
+
+int kv_tree_dump(kv_tree* t, int fd){
+    if(t == NULL || fd < 0){
+        return CODE_INVALID_PARAMETER;
+    }
+
+    kv_dump_header header = {.magic = KV_DUMP_MAGIC, .version = KV_DUMP_VERSION};
+    int ret = kv_write_full(fd, &header, sizeof(header));
+    if(ret != CODE_SUCCEED || t->root == NULL_PAGE){
+        return ret;
+    }
+    return t->kv->layout->dump(t, fd);
+}
+
+int kv_load(kv_file* kv, int fd){
+    return kv_tree_load(&kv->main, fd);
+}
+
+// an empty tree is bulk built while keys ascend, anything else goes through kv_tree_put
+int kv_tree_load(kv_tree* t, int fd){
+    if(t == NULL || fd < 0){
+        return CODE_INVALID_PARAMETER;
+    }
+
+    kv_dump_header header;
+    size_t got = 0;
+    int ret = kv_read_full(fd, &header, sizeof(header), &got);
+    if(ret != CODE_SUCCEED){
+        return ret;
+    }
+    if(got != sizeof(header) || header.magic != KV_DUMP_MAGIC || header.version != KV_DUMP_VERSION){
+        return CODE_CORRUPTED;
+    }
+    return t->kv->layout->load(t, fd);
+}
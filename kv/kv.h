@@ -5,16 +5,175 @@
 #include "define.h"
 
 typedef struct __kv_file kv_file;
+typedef struct __kv_tree kv_tree;
+typedef struct __kv_backup_job kv_backup_job;
 
+#define KV_DEFAULT_CACHE_PAGES 1024
+#define KV_DEFAULT_PAGE_SIZE   (4*1024)
+// named tree names including the terminating zero
+#define KV_TREE_NAME_SIZE 28
+
+typedef struct __kv_options{
+    uint32_t cache_pages;   // cache size in pages
+    uint32_t page_size;     // power of two in [4k, 64k], only used when the file is created
+    uint8_t  key_bits;      // 32 or 64, narrower keys and values fit more records in a page,
+    uint8_t  value_bits;    // only used when the file is created
+    bool     warm_cache;    // prefetch the pages that were cached at last close
+    bool     lazy_delete;   // defer rebalancing of underfull leaves, see kv_maintain
+}kv_options;
+
+#define KV_AGG_COUNT 1
+#define KV_AGG_SUM   2
+#define KV_AGG_MIN   4
+#define KV_AGG_MAX   8
+#define KV_AGG_ALL   (KV_AGG_COUNT | KV_AGG_SUM | KV_AGG_MIN | KV_AGG_MAX)
+
+typedef struct __kv_aggregate{
+    int      ops;
+    uint64_t count;
+    int64_t  sum;
+    int64_t  min;
+    int64_t  max;
+}kv_aggregate;
+
+// result of the structural integrity check
+typedef struct __kv_check_result{
+    uint32_t page_num;
+    uint32_t height;
+    uint32_t tree_pages;
+    uint32_t free_pages;
+    uint32_t underfull_pages;
+    uint64_t records;
+    // errors
+    uint32_t bad_page_id;
+    uint32_t bad_type;
+    uint32_t bad_order;
+    uint32_t bad_bound;
+    uint32_t bad_parent;
+    uint32_t bad_next;
+    uint32_t unbalanced;
+    uint32_t duplicate_pages;
+    uint32_t leaked_pages;
+    uint32_t bad_free;
+    uint64_t errors;
+}kv_check_result;
+
+// a run of records inside one leaf handed out without copying, only valid
+// for the duration of the callback
+typedef struct __kv_span{
+    const int64_t* keys;
+    const int64_t* values;
+    uint16_t       count;
+    uint16_t       stride;
+}kv_span;
+
+#define KV_SPAN_KEY(__S__, __I__)   ((__S__)->keys[(__I__) * (__S__)->stride])
+#define KV_SPAN_VALUE(__S__, __I__) ((__S__)->values[(__I__) * (__S__)->stride])
+
+// one get, put or del of kv_apply_batch, value is read for put and set by get
+#define KV_OP_GET 1
+#define KV_OP_PUT 2
+#define KV_OP_DEL 3
+
+typedef struct __kv_op{
+    uint8_t type;
+    int     ret;
+    int64_t key;
+    int64_t value;
+}kv_op;
+
+// called by kv_update with the current value, or exists false and value 0 for a missing key.
+// returning false leaves the record as it is, it must not call back into the database
+typedef bool (*kv_update_fn)(void* ctx, int64_t key, bool exists, int64_t* value);
+
+#define KV_STATS_FILL_BUCKETS 10
+
+typedef struct __kv_stats{
+    // cache
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    uint64_t dirty_evictions;
+    uint64_t pages_read;
+    uint64_t pages_written;
+    uint64_t dirty_flushes;
+    uint64_t flush_usec;
+    uint64_t flush_usec_max;
+    uint32_t cache_pages;
+    uint32_t node_pool_pages;   // internal nodes resident on top of cache_pages
+    uint32_t dirty_pages;
+    // file & tree
+    uint64_t file_extends;
+    uint64_t splits;
+    uint64_t merges;
+    uint64_t borrows;
+    uint64_t hinted_puts;       // puts that went to the leaf of the previous put without a descent
+    uint32_t page_num;
+    uint32_t page_size;
+    uint32_t key_bits;
+    uint32_t value_bits;
+    uint32_t tree_height;
+    uint32_t node_pages;
+    uint32_t leaf_pages;
+    uint64_t records;
+    // page fill distribution, bucket i counts pages filled [i*10%, (i+1)*10%)
+    uint32_t node_fill[KV_STATS_FILL_BUCKETS];
+    uint32_t leaf_fill[KV_STATS_FILL_BUCKETS];
+}kv_stats;
+
+void     kv_options_init(kv_options* opts);
 kv_file* kv_open(const char* name);
+kv_file* kv_open_ex(const char* name, const kv_options* opts);
 int      kv_close(kv_file* kv);
 int      kv_put(kv_file* kv, int64_t key, int64_t value);
 int      kv_del(kv_file* kv, int64_t key);
+int      kv_del_range(kv_file* kv, int64_t min, int64_t max);
 int      kv_get(kv_file* kv, int64_t key, int64_t* value);
+int      kv_update(kv_file* kv, int64_t key, kv_update_fn fn, void* ctx);
+int      kv_incr(kv_file* kv, int64_t key, int64_t delta, int64_t* value);
+int      kv_cas(kv_file* kv, int64_t key, int64_t expected, int64_t desired);
 int      kv_next(kv_file* kv, int64_t sk, int64_t* key, int64_t* value);
 void     kv_range(kv_file* kv, int64_t min, int64_t max, void* ptr, void (*callback)(void* ptr, int64_t key, int64_t value));
+void     kv_range_spans(kv_file* kv, int64_t min, int64_t max, void* ptr, void (*callback)(void* ptr, const kv_span* span));
+uint32_t kv_range_copy(kv_file* kv, int64_t min, int64_t max, kv_record* out, uint32_t num);
+int      kv_range_aggregate(kv_file* kv, int64_t min, int64_t max, int ops, kv_aggregate* result);
+int      kv_apply_batch(kv_file* kv, kv_op* ops, uint32_t num);
+int      kv_flush(kv_file* kv);
 int      kv_clear(kv_file *kv);
 void     kv_iterate(kv_file*kv, void* ptr, void(*f)(void* ptr, uint16_t page, int64_t key, int64_t value));
+int      kv_parallel_iterate(kv_file* kv, uint16_t nthreads, void** ptrs, void(*f)(void* ptr, uint16_t page, int64_t key, int64_t value));
+int      kv_get_stats(kv_file* kv, kv_stats* stats);
+int      kv_check(kv_file* kv, uint16_t nthreads, kv_check_result* result);
+uint32_t kv_maintain(kv_file* kv);
+
+// online backup: kv_backup_begin fixes the image, steps copy it in file order while
+// the database stays writable. kv_backup does all steps at once
+kv_backup_job* kv_backup_begin(kv_file* kv, int fd);
+int            kv_backup_step(kv_backup_job* b, uint32_t pages, uint32_t* left);
+int            kv_backup_end(kv_backup_job* b);
+int            kv_backup(kv_file* kv, int fd);
+// logical dump as key ordered records, loading into an empty tree builds it bottom up
+int      kv_dump(kv_file* kv, int fd);
+int      kv_load(kv_file* kv, int fd);
+
+// named trees share the cache and free pages of their file, handles stay valid until kv_close
+kv_tree* kv_tree_open(kv_file* kv, const char* name);
+int      kv_tree_put(kv_tree* t, int64_t key, int64_t value);
+int      kv_tree_del(kv_tree* t, int64_t key);
+int      kv_tree_del_range(kv_tree* t, int64_t min, int64_t max);
+int      kv_tree_get(kv_tree* t, int64_t key, int64_t* value);
+int      kv_tree_update(kv_tree* t, int64_t key, kv_update_fn fn, void* ctx);
+int      kv_tree_incr(kv_tree* t, int64_t key, int64_t delta, int64_t* value);
+int      kv_tree_cas(kv_tree* t, int64_t key, int64_t expected, int64_t desired);
+int      kv_tree_next(kv_tree* t, int64_t sk, int64_t* key, int64_t* value);
+void     kv_tree_range(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void* ptr, int64_t key, int64_t value));
+void     kv_tree_range_spans(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void* ptr, const kv_span* span));
+uint32_t kv_tree_range_copy(kv_tree* t, int64_t min, int64_t max, kv_record* out, uint32_t num);
+int      kv_tree_range_aggregate(kv_tree* t, int64_t min, int64_t max, int ops, kv_aggregate* result);
+void     kv_tree_iterate(kv_tree* t, void* ptr, void(*f)(void* ptr, uint16_t page, int64_t key, int64_t value));
+int      kv_tree_apply_batch(kv_tree* t, kv_op* ops, uint32_t num);
+int      kv_tree_dump(kv_tree* t, int fd);
+int      kv_tree_load(kv_tree* t, int fd);
 
 // for test
 kv_page* kv_page_create(kv_file* kv, uint16_t type);
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "scan.h"
+#include "log.h"
+
+typedef struct __scan_worker{
+    pthread_t      tid;
+    int            fd;
+    size_t         offset;
+    uint32_t       page_size;
+    scan_unpack_fn unpack;
+    scan_range*    range;
+    scan_record_fn f;
+}scan_worker;
+
+bool scan_pread_page(int fd, size_t offset, uint32_t page_size, uint32_t page, kv_page* buf){
+    ssize_t ret = pread(fd, buf, page_size, offset + (size_t)page_size * page);
+    return ret == page_size;
+}
+
+void scan_read_page(int fd, size_t offset, uint32_t page_size, uint32_t page, kv_page* buf){
+    if(!scan_pread_page(fd, offset, page_size, page, buf)){
+        FATAL("scan read page %u error: %d", page, errno);
+    }
+    if(buf->page != page){
+        FATAL("invalid page read from file: %u %u", buf->page, page);
+    }
+}
+
+void* scan_leaf_worker(void* arg){
+    scan_worker* w = (scan_worker*)arg;
+    kv_page*     p = (kv_page*)malloc(w->page_size);
+    // records take at least 8 bytes in a page and 16 once unpacked
+    kv_record*   unpacked = w->unpack != NULL ? (kv_record*)malloc((size_t)w->page_size * 2) : NULL;
+
+    uint32_t page = w->range->first;
+    for(; page != NULL_PAGE && page != w->range->stop;){
+        scan_read_page(w->fd, w->offset, w->page_size, page, p);
+        kv_record* records = KV_PAGE_RECORDS(p);
+        if(unpacked != NULL){
+            w->unpack(p, unpacked);
+            records = unpacked;
+        }
+        for(uint16_t i=0; i<p->record_num; ++i){
+            w->f(w->range->ptr, page, records[i].key, records[i+1].value);
+        }
+        page = p->next_page;
+    }
+
+    free(p);
+    free(unpacked);
+    return NULL;
+}
+
+void scan_leaf_ranges(int fd, size_t offset, uint32_t page_size, scan_unpack_fn unpack, scan_range* ranges, uint16_t num,
+                      scan_record_fn f){
+    scan_worker* workers = (scan_worker*)malloc(sizeof(scan_worker) * num);
+    for(uint16_t i=0; i<num; ++i){
+        scan_worker* w = workers + i;
+        w->fd     = fd;
+        w->offset = offset;
+        w->page_size = page_size;
+        w->unpack = unpack;
+        w->range  = ranges + i;
+        w->f      = f;
+        if(pthread_create(&w->tid, NULL, scan_leaf_worker, w) != 0){
+            FATAL("create scan worker failed with errno: %d", errno);
+        }
+    }
+    for(uint16_t i=0; i<num; ++i){
+        pthread_join(workers[i].tid, NULL);
+    }
+    free(workers);
+}
@@ -0,0 +1,25 @@
+#ifndef __KV_SCAN_H__
+#define __KV_SCAN_H__
+#include <stdio.h>
+#include <stdbool.h>
+#include "define.h"
+
+// a run of the leaf chain starting at page first and ending before page stop,
+// scanned by one worker thread with its own reads
+typedef struct __scan_range{
+    uint32_t first;
+    uint32_t stop;
+    void*    ptr;
+}scan_range;
+
+typedef void (*scan_record_fn)(void* ptr, uint16_t page, int64_t key, int64_t value);
+// copies the records of a page with narrower keys or values into kv_record slots, same
+// pairing of records[i].key with records[i+1].value. NULL for pages of kv_record
+typedef void (*scan_unpack_fn)(const kv_page* p, kv_record* records);
+
+bool scan_pread_page(int fd, size_t offset, uint32_t page_size, uint32_t page, kv_page* buf);
+void scan_read_page(int fd, size_t offset, uint32_t page_size, uint32_t page, kv_page* buf);
+void scan_leaf_ranges(int fd, size_t offset, uint32_t page_size, scan_unpack_fn unpack, scan_range* ranges, uint16_t num,
+                      scan_record_fn f);
+
+#endif//__KV_SCAN_H__
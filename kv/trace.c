@@ -0,0 +1,192 @@
+#ifdef KV_TRACE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "trace.h"
+
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_MAX_DEPTH 8
+
+#pragma pack(1)
+typedef struct __trace_event{
+    uint64_t begin;
+    uint64_t cycles;
+    uint64_t self;
+    uint32_t seq;
+    uint8_t  depth;
+    uint8_t  stack[TRACE_MAX_DEPTH];
+}trace_event;
+#pragma pack()
+
+typedef struct __trace_frame{
+    uint8_t  phase;
+    uint64_t begin;
+    uint64_t child;
+}trace_frame;
+
+typedef struct __trace_ring{
+    struct __trace_ring* next;
+    uint32_t    tid;
+    uint32_t    op_count;
+    uint32_t    seq;
+    bool        sampled;
+    uint8_t     depth;
+    trace_frame frames[TRACE_MAX_DEPTH];
+    uint64_t    head;
+    trace_event events[TRACE_RING_SIZE];
+}trace_ring;
+
+static const char* trace_phase_names[TRACE_PHASE_NUM] = {
+    "put", "get", "del", "descent", "page_load", "split", "merge", "flush"
+};
+
+static uint32_t        trace_sample = 1;
+static uint32_t        trace_tid    = 0;
+static trace_ring*     trace_rings  = NULL;
+static pthread_mutex_t trace_lock   = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        trace_base_tsc, trace_base_nsec;
+static __thread trace_ring* trace_local = NULL;
+
+static uint64_t trace_nsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t trace_tsc(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return trace_nsec();
+#endif
+}
+
+static trace_ring* trace_ring_get(){
+    if(trace_local != NULL){
+        return trace_local;
+    }
+
+    trace_ring* r = (trace_ring*)calloc(1, sizeof(trace_ring));
+    pthread_mutex_lock(&trace_lock);
+    if(trace_rings == NULL){
+        trace_base_tsc  = trace_tsc();
+        trace_base_nsec = trace_nsec();
+    }
+    r->tid  = trace_tid++;
+    r->next = trace_rings;
+    trace_rings = r;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_local = r;
+    return r;
+}
+
+void trace_set_sample(uint32_t n){
+    trace_sample = n > 0 ? n : 1;
+}
+
+void trace_op_begin(uint8_t op){
+    trace_ring* r = trace_ring_get();
+    r->sampled = (r->op_count++ % trace_sample) == 0;
+    r->depth   = 0;
+    if(r->sampled){
+        r->seq += 1;
+        trace_begin(op);
+    }
+}
+
+void trace_op_end(){
+    trace_ring* r = trace_local;
+    if(r == NULL || !r->sampled){
+        return;
+    }
+    // close frames left open by early returns
+    for(; r->depth > 0;){
+        trace_end();
+    }
+    r->sampled = false;
+}
+
+void trace_begin(uint8_t phase){
+    trace_ring* r = trace_local;
+    if(r == NULL || !r->sampled){
+        return;
+    }
+    if(r->depth >= TRACE_MAX_DEPTH){
+        r->depth += 1;
+        return;
+    }
+
+    trace_frame* f = r->frames + r->depth;
+    f->phase = phase;
+    f->child = 0;
+    r->depth += 1;
+    f->begin = trace_tsc();
+}
+
+void trace_end(){
+    uint64_t end = trace_tsc();
+    trace_ring* r = trace_local;
+    if(r == NULL || !r->sampled || r->depth == 0){
+        return;
+    }
+
+    r->depth -= 1;
+    if(r->depth >= TRACE_MAX_DEPTH){
+        return;
+    }
+
+    trace_frame* f = r->frames + r->depth;
+    trace_event* e = r->events + (r->head++ % TRACE_RING_SIZE);
+    e->begin  = f->begin;
+    e->cycles = end - f->begin;
+    e->self   = e->cycles > f->child ? e->cycles - f->child : 0;
+    e->seq    = r->seq;
+    e->depth  = r->depth;
+    for(uint8_t i=0; i<=r->depth; ++i){
+        e->stack[i] = r->frames[i].phase;
+    }
+
+    if(r->depth > 0){
+        r->frames[r->depth-1].child += e->cycles;
+    }
+}
+
+void trace_dump(FILE* f, int format){
+    pthread_mutex_lock(&trace_lock);
+    double ns_per_cycle = 1.0;
+    uint64_t cycles = trace_tsc() - trace_base_tsc;
+    if(cycles > 0){
+        ns_per_cycle = (double)(trace_nsec() - trace_base_nsec) / cycles;
+    }
+
+    if(format == TRACE_DUMP_EVENTS){
+        fprintf(f, "# ns_per_cycle %.6f\n", ns_per_cycle);
+        fprintf(f, "# tid seq depth phase begin_tsc cycles self_cycles nsec\n");
+    }
+
+    for(trace_ring* r = trace_rings; r != NULL; r = r->next){
+        uint64_t first = r->head > TRACE_RING_SIZE ? r->head - TRACE_RING_SIZE : 0;
+        for(uint64_t n=first; n<r->head; ++n){
+            trace_event* e = r->events + (n % TRACE_RING_SIZE);
+            if(format == TRACE_DUMP_EVENTS){
+                fprintf(f, "%u %u %u %s %lu %lu %lu %.0f\n", r->tid, e->seq, e->depth,
+                        trace_phase_names[e->stack[e->depth]], e->begin, e->cycles, e->self,
+                        e->cycles * ns_per_cycle);
+            }else{
+                for(uint8_t i=0; i<=e->depth; ++i){
+                    fprintf(f, i == 0 ? "%s" : ";%s", trace_phase_names[e->stack[i]]);
+                }
+                fprintf(f, " %.0f\n", e->self * ns_per_cycle);
+            }
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#endif//KV_TRACE
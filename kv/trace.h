@@ -0,0 +1,44 @@
+#ifndef __KV_TRACE_H__
+#define __KV_TRACE_H__
+#include <stdio.h>
+#include <stdint.h>
+
+// trace phases, the first ones are top level operations
+#define TRACE_PUT       0
+#define TRACE_GET       1
+#define TRACE_DEL       2
+#define TRACE_DESCENT   3
+#define TRACE_PAGE_LOAD 4
+#define TRACE_SPLIT     5
+#define TRACE_MERGE     6
+#define TRACE_FLUSH     7
+#define TRACE_PHASE_NUM 8
+
+// dump formats
+#define TRACE_DUMP_EVENTS 1   // one line per event, for per-phase latency breakdown
+#define TRACE_DUMP_FOLDED 2   // folded stacks with self time, for flamegraph.pl
+
+#ifdef KV_TRACE
+
+void trace_set_sample(uint32_t n);
+void trace_op_begin(uint8_t op);
+void trace_op_end();
+void trace_begin(uint8_t phase);
+void trace_end();
+void trace_dump(FILE* f, int format);
+
+#define TRACE_OP_BEGIN(__OP__)   trace_op_begin(__OP__);
+#define TRACE_OP_END()           trace_op_end();
+#define TRACE_BEGIN(__PHASE__)   trace_begin(__PHASE__);
+#define TRACE_END()              trace_end();
+
+#else
+
+#define TRACE_OP_BEGIN(__OP__)
+#define TRACE_OP_END()
+#define TRACE_BEGIN(__PHASE__)
+#define TRACE_END()
+
+#endif//KV_TRACE
+
+#endif//__KV_TRACE_H__
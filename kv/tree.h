@@ -0,0 +1,1450 @@
+#ifndef __KV_TREE_H__
+#define __KV_TREE_H__
+// tree code for one record layout. each tree_k*v*.c defines the key and value widths
+// and the name and id of its layout before including this file, everything here is
+// static so every layout gets its own copy with the widths fixed at compile time
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "trace.h"
+#include "log.h"
+
+#define KV_TREE_INT_(__BITS__) int##__BITS__##_t
+#define KV_TREE_INT(__BITS__)  KV_TREE_INT_(__BITS__)
+
+typedef KV_TREE_INT(KV_KEY_BITS)   kv_tree_key;
+typedef KV_TREE_INT(KV_VALUE_BITS) kv_tree_value;
+
+// kv_record of the layout, nodes keep child page numbers in the values
+#pragma pack(1)
+typedef struct __kv_tree_record{
+    kv_tree_key   key;
+    kv_tree_value value;
+}kv_tree_record;
+#pragma pack()
+
+#define KV_TREE_RECORDS(__P__) ((kv_tree_record*)KV_PAGE_RECORDS(__P__))
+// records of the layout are kv_record
+#define KV_TREE_NATIVE (KV_KEY_BITS == 64 && KV_VALUE_BITS == 64)
+// whether a record can be stored without losing bits, always true for 64 bits
+#define KV_TREE_FITS(__KEY__, __VALUE__) ((__KEY__) == (kv_tree_key)(__KEY__) && (__VALUE__) == (kv_tree_value)(__VALUE__))
+
+// interpolation guesses per in-page search, 0 leaves only the binary search
+#ifndef KV_SEARCH_PROBES
+#define KV_SEARCH_PROBES    2
+#endif
+// ranges this small are left to the binary search
+#define KV_SEARCH_MIN_RANGE 16
+#define KV_SEARCH_GAP       8
+#define KV_SEARCH_PAST(__RECORD_KEY__, __KEY__, __UPPER__) \
+    ((__UPPER__) ? (__RECORD_KEY__) > (__KEY__) : (__RECORD_KEY__) >= (__KEY__))
+
+static int tree_put(kv_tree* t, int64_t key, int64_t value);
+static uint32_t tree_maintain(kv_file* kv);
+static kv_page* tree_leftmost_leaf(kv_file* kv, uint32_t page);
+static void tree_page_set(kv_file* kv, kv_page* p, int64_t key, int64_t value);
+static kv_page* kv_find_leaf_page(kv_file* kv, kv_page* p, int64_t key);
+static void kv_range_walk(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*f)(void*, kv_tree_record*, uint16_t, uint16_t));
+static uint16_t kv_find_child_index(kv_page* p, int64_t key);
+static void kv_page_merge_if_need(kv_file* kv, uint32_t* root, kv_page* p);
+static void kv_page_del(kv_file* kv, kv_page* p, int64_t key);
+static void kv_page_split_if_need(kv_file* kv, uint32_t* root, kv_page* p);
+static uint16_t kv_page_find_insert_index(kv_page* p, int64_t key);
+static void kv_page_insert(kv_file* kv, kv_page* p, uint16_t index, int64_t key, int64_t value);
+static void kv_defer_rebalance(kv_tree* t, kv_page* leaf, int64_t key);
+static void kv_leaf_rebalance(kv_tree* t, kv_page* leaf, int64_t key);
+static kv_page* kv_hint_leaf(kv_tree* t, int64_t key);
+static kv_page* kv_find_leaf_hinted(kv_tree* t, int64_t key);
+
+static int tree_put(kv_tree* t, int64_t key, int64_t value){
+    kv_file* kv = t->kv;
+    if(!KV_TREE_FITS(key, value)){
+        return CODE_INVALID_PARAMETER;
+    }
+    TRACE_OP_BEGIN(TRACE_PUT)
+    if(t->root == NULL_PAGE){
+        kv_page *new = kv_page_create(kv, KV_PAGE_DATA);
+        t->root = new->page;
+    }
+
+    TRACE_BEGIN(TRACE_DESCENT)
+    kv_page* leaf = kv_hint_leaf(t, key);
+    if(leaf == NULL){
+        leaf = kv_find_leaf_hinted(t, key);
+    }
+    leaf = kv_page_pin(kv, leaf->page);
+    TRACE_END()
+    tree_page_set(kv, leaf, key, value);
+    kv_page_split_if_need(kv, &t->root, leaf);
+    kv_unpin_all(kv);
+
+    // flush dirty
+    kv_dirty_flush(kv, false);
+    TRACE_OP_END()
+    return 0;
+}
+
+// one descent for the read and the write, the record is changed in place and only
+// inserting a missing key can split the leaf
+static int tree_update(kv_tree* t, int64_t key, kv_update_fn fn, void* ctx){
+    kv_file* kv = t->kv;
+    int64_t  value;
+    if(t->root == NULL_PAGE){
+        value = 0;
+        if(!fn(ctx, key, false, &value)){
+            return CODE_SUCCEED;
+        }
+        return tree_put(t, key, value);
+    }
+
+    TRACE_OP_BEGIN(TRACE_PUT)
+    TRACE_BEGIN(TRACE_DESCENT)
+    kv_page* leaf = kv_find_leaf_page(kv, kv_page_at(kv, t->root), key);
+    TRACE_END()
+    uint16_t        index   = kv_page_find_insert_index(leaf, key);
+    kv_tree_record* records = KV_TREE_RECORDS(leaf);
+    bool            exists  = index < leaf->record_num && records[index].key == key;
+    int             ret     = CODE_SUCCEED;
+    value = exists ? records[index+1].value : 0;
+    bool write = fn(ctx, key, exists, &value) && !(exists && value == records[index+1].value);
+    if(write && !KV_TREE_FITS(key, value)){
+        ret = CODE_INVALID_PARAMETER;
+    }else if(write && exists){
+        records[index+1].value = value;
+        kv_dirty_page(kv, leaf->page);
+    }else if(write){
+        leaf = kv_page_pin(kv, leaf->page);
+        kv_page_insert(kv, leaf, index, key, value);
+        kv_page_split_if_need(kv, &t->root, leaf);
+        kv_unpin_all(kv);
+    }
+
+    kv_dirty_flush(kv, false);
+    TRACE_OP_END()
+    return ret;
+}
+
+static int tree_del(kv_tree* t, int64_t key){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE){
+        return 0;
+    }
+    TRACE_OP_BEGIN(TRACE_DEL)
+    TRACE_BEGIN(TRACE_DESCENT)
+    kv_page* leaf = kv_find_leaf_page(kv, kv_page_at(kv, t->root), key);
+    leaf = kv_page_pin(kv, leaf->page);
+    TRACE_END()
+    kv_page_del(kv, leaf, key);
+    kv_leaf_rebalance(t, leaf, key);
+    kv_unpin_all(kv);
+    if(kv->pending_num >= KV_LAZY_BATCH){
+        tree_maintain(kv);
+    }
+
+    //
+    kv_dirty_flush(kv, false);
+    TRACE_OP_END()
+    return 0;
+}
+
+// rebalance a leaf after a delete, at once or through the pending list in lazy mode.
+// a lazy leaf rebalanced at once is still deferred, a borrow may leave it underfull
+static void kv_leaf_rebalance(kv_tree* t, kv_page* leaf, int64_t key){
+    kv_file* kv = t->kv;
+    if(!kv->lazy_delete){
+        kv_page_merge_if_need(kv, &t->root, leaf);
+        return;
+    }
+    if(leaf->record_num < kv->min_records){
+        kv_defer_rebalance(t, leaf, key);
+    }
+    if(leaf->record_num < KV_PAGE_LAZY_MIN_RECORDS(kv->order)){
+        kv_page_merge_if_need(kv, &t->root, leaf);
+    }
+}
+
+// ops run in order with the same results as separate calls, but the lazy maintenance
+// and flush check run once per batch, and the leaf of the last op is reused while keys
+// stay inside its key range
+static int tree_apply_batch(kv_tree* t, kv_op* ops, uint32_t num){
+    kv_file* kv   = t->kv;
+    uint32_t last = NULL_PAGE;
+    for(uint32_t i=0; i<num; ++i){
+        kv_op* op = ops + i;
+        op->ret = CODE_SUCCEED;
+        if((op->type != KV_OP_GET && op->type != KV_OP_PUT && op->type != KV_OP_DEL) ||
+           (op->type == KV_OP_PUT && !KV_TREE_FITS(op->key, op->value))){
+            op->ret = CODE_INVALID_PARAMETER;
+            continue;
+        }
+        if(t->root == NULL_PAGE){
+            if(op->type != KV_OP_PUT){
+                op->ret = op->type == KV_OP_GET ? CODE_KEY_NOT_EXIST : CODE_SUCCEED;
+                continue;
+            }
+            t->root = kv_page_create(kv, KV_PAGE_DATA)->page;
+            kv_unpin_all(kv);
+        }
+
+        kv_page*        leaf    = last != NULL_PAGE ? kv_page_at(kv, last) : NULL;
+        kv_tree_record* records = leaf != NULL ? KV_TREE_RECORDS(leaf) : NULL;
+        if(leaf == NULL || leaf->record_num == 0 || op->key < records[0].key ||
+           op->key > records[leaf->record_num-1].key){
+            TRACE_BEGIN(TRACE_DESCENT)
+            leaf = kv_find_leaf_page(kv, kv_page_at(kv, t->root), op->key);
+            TRACE_END()
+        }
+        last = leaf->page;
+
+        if(op->type == KV_OP_GET){
+            uint16_t index = kv_page_find_insert_index(leaf, op->key);
+            records = KV_TREE_RECORDS(leaf);
+            if(index >= leaf->record_num || records[index].key != op->key){
+                op->ret = CODE_KEY_NOT_EXIST;
+            }else{
+                op->value = records[index+1].value;
+            }
+            continue;
+        }
+
+        // a split or rebalance may move the keys around the leaf
+        leaf = kv_page_pin(kv, last);
+        if(op->type == KV_OP_PUT){
+            tree_page_set(kv, leaf, op->key, op->value);
+            if(leaf->record_num >= kv->order){
+                kv_page_split_if_need(kv, &t->root, leaf);
+                last = NULL_PAGE;
+            }
+        }else{
+            kv_page_del(kv, leaf, op->key);
+            if(leaf->record_num < kv->min_records){
+                kv_leaf_rebalance(t, leaf, op->key);
+                last = NULL_PAGE;
+            }
+        }
+        kv_unpin_all(kv);
+    }
+
+    if(kv->pending_num >= KV_LAZY_BATCH){
+        tree_maintain(kv);
+    }
+    kv_dirty_flush(kv, false);
+    return CODE_SUCCEED;
+}
+
+static uint16_t kv_tree_height(kv_file* kv, uint32_t root){
+    uint16_t height = 0;
+    for(uint32_t page = root; page != NULL_PAGE; ++height){
+        kv_page* p = kv_page_at(kv, page);
+        page = p->type == KV_PAGE_DATA ? NULL_PAGE : KV_TREE_RECORDS(p)[0].value;
+    }
+    return height;
+}
+
+static uint32_t kv_leaf_page_of(kv_file* kv, uint32_t root, int64_t key){
+    return kv_find_leaf_page(kv, kv_page_at(kv, root), key)->page;
+}
+
+// free a subtree whose root is level levels above the leaves, leaves are
+// released without being read
+static void kv_page_free_subtree(kv_file* kv, uint32_t page, uint16_t level){
+    if(level <= 1){
+        kv_page_free(kv, cache_new_page(kv->cache, page));
+        return;
+    }
+
+    uint32_t children[kv->order + 1];
+    kv_page* p = kv_page_at(kv, page);
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t num = p->record_num + 1;
+    for(uint16_t i=0; i<num; ++i){
+        children[i] = records[i].value;
+    }
+    kv_page_free(kv, p);
+    for(uint16_t i=0; i<num; ++i){
+        kv_page_free_subtree(kv, children[i], level - 1);
+    }
+}
+
+// delete keys in [min, max) below page, whose keys lie in [lo, hi) with hi
+// unbounded unless has_hi, children lying inside the range are freed whole
+static void kv_page_del_range(kv_file* kv, uint32_t page, uint16_t level, int64_t min, int64_t max,
+                              int64_t lo, bool has_hi, int64_t hi){
+    if(level <= 1){
+        kv_page* p = kv_page_at(kv, page);
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+        uint16_t begin = kv_page_find_insert_index(p, min);
+        uint16_t end   = kv_page_find_insert_index(p, max);
+        if(begin >= end){
+            return;
+        }
+        uint16_t num = end - begin;
+        for(uint16_t i=end; i<p->record_num; ++i){
+            records[i-num].key     = records[i].key;
+            records[i-num+1].value = records[i+1].value;
+        }
+        p->record_num -= num;
+        kv_dirty_page(kv, page);
+        return;
+    }
+
+    kv_page* p = kv_page_pin(kv, page);
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    int32_t drop_first = -1, drop_last = -1;
+    for(uint16_t i=0; i<=p->record_num; ++i){
+        int64_t child_lo = i > 0 ? records[i-1].key : lo;
+        bool    child_has_hi = i < p->record_num || has_hi;
+        int64_t child_hi = i < p->record_num ? records[i].key : hi;
+        if(child_lo >= max){
+            break;
+        }
+        if(child_has_hi && child_hi <= min){
+            continue;
+        }
+
+        if(min <= child_lo && child_has_hi && child_hi <= max){
+            if(drop_first < 0){
+                drop_first = i;
+            }
+            drop_last = i;
+            kv_page_free_subtree(kv, records[i].value, level - 1);
+        }else{
+            kv_page_del_range(kv, records[i].value, level - 1, min, max, child_lo, child_has_hi, child_hi);
+        }
+    }
+    if(drop_first < 0){
+        return;
+    }
+
+    // children drop_first..drop_last go with the separators in front of them,
+    // or with the ones behind them when the first child is dropped. the last
+    // child is dropped too when the node has hi <= max and min is at or below
+    // its lower separator, then drop_last == record_num and nothing is shifted.
+    // a node is never dropped whole here, its parent frees covered subtrees
+    uint16_t num = drop_last - drop_first + 1;
+    for(uint16_t i=drop_last+1; i<=p->record_num; ++i){
+        records[i-num].value = records[i].value;
+        if(drop_first > 0){
+            records[i-1-num].key = records[i-1].key;
+        }else if(i < p->record_num){
+            records[i-num].key = records[i].key;
+        }
+    }
+    p->record_num -= num;
+    kv_dirty_page(kv, page);
+}
+
+// rebalance the pages on the path to key from the leaf up, returns whether
+// anything changed
+static bool kv_rebalance_path(kv_file* kv, uint32_t* root, int64_t key){
+    bool changed = false;
+    for(uint16_t level=1; *root != NULL_PAGE;){
+        uint32_t path[KV_MAX_HEIGHT];
+        uint16_t num = 0;
+        for(uint32_t page = *root; num < KV_MAX_HEIGHT;){
+            kv_page* p = kv_page_at(kv, page);
+            path[num++] = page;
+            if(p->type == KV_PAGE_DATA){
+                break;
+            }
+            page = KV_TREE_RECORDS(p)[kv_find_child_index(p, key)].value;
+        }
+        if(level > num){
+            break;
+        }
+
+        // a page that is the only child of its parent waits for the parent
+        kv_page* p = kv_page_pin(kv, path[num-level]);
+        bool underfull = p->parent == NULL_PAGE ? p->record_num == 0 :
+                         p->record_num < kv->min_records && kv_page_at(kv, p->parent)->record_num > 0;
+        if(underfull){
+            kv_page_merge_if_need(kv, root, p);
+            changed = true;
+        }else{
+            ++level;
+        }
+        kv_unpin_all(kv);
+    }
+    return changed;
+}
+
+static int tree_del_range(kv_tree* t, int64_t min, int64_t max){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE){
+        return CODE_SUCCEED;
+    }
+    // separators inside the range go away with the subtrees they bound
+    kv->tree_version += 1;
+
+    // the leaves holding min - 1 and max survive and become neighbours
+    bool     has_left = min != INT64_MIN;
+    uint32_t left  = has_left ? kv_leaf_page_of(kv, t->root, min - 1) : NULL_PAGE;
+    uint32_t right = kv_leaf_page_of(kv, t->root, max);
+
+    kv_page_del_range(kv, t->root, kv_tree_height(kv, t->root), min, max, INT64_MIN, false, 0);
+    kv_unpin_all(kv);
+    if(has_left && left != right){
+        kv_page* p = kv_page_at(kv, left);
+        p->next_page = right;
+        kv_dirty_page(kv, left);
+    }
+
+    // every page that lost keys lies on one of the two boundary paths, a
+    // fix on one path may leave work on the other so repeat until stable
+    for(bool changed = true; changed;){
+        changed = has_left ? kv_rebalance_path(kv, &t->root, min - 1) : false;
+        changed = kv_rebalance_path(kv, &t->root, max) || changed;
+    }
+
+    kv_dirty_flush(kv, false);
+    return CODE_SUCCEED;
+}
+
+static int tree_get(kv_tree* t, int64_t key, int64_t* value){
+    if(t->root == NULL_PAGE){
+        return CODE_KEY_NOT_EXIST;
+    }
+
+    TRACE_OP_BEGIN(TRACE_GET)
+    TRACE_BEGIN(TRACE_DESCENT)
+    kv_page* leaf  = kv_find_leaf_page(t->kv, kv_page_at(t->kv, t->root), key);
+    TRACE_END()
+    uint16_t index = kv_page_find_insert_index(leaf, key);
+    kv_tree_record* records = KV_TREE_RECORDS(leaf);
+    TRACE_OP_END()
+    if(index >= leaf->record_num || records[index].key != key){
+        return CODE_KEY_NOT_EXIST;
+    }
+    *value = records[index+1].value;
+    return 0;
+}
+
+static int tree_next(kv_tree* t, int64_t sk, int64_t* key, int64_t* value){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE){
+        return CODE_KEY_NOT_EXIST;
+    }
+    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, t->root), sk);
+    uint16_t index = kv_page_find_insert_index(leaf, sk);
+    kv_tree_record* records = KV_TREE_RECORDS(leaf);
+
+    if(index < leaf->record_num && records[index].key == sk){
+        ++index;
+    }
+
+    if(index >= leaf->record_num && leaf->next_page == NULL_PAGE){
+        return CODE_KEY_NOT_EXIST;
+    }else if(index >= leaf->record_num && leaf->next_page != NULL_PAGE){
+        leaf = kv_page_at(kv, leaf->next_page);
+        index = 0;
+    }
+
+    records = KV_TREE_RECORDS(leaf);
+    *key   = records[index].key;
+    *value = records[index+1].value;
+    return 0;
+}
+
+static void tree_range(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, int64_t, int64_t)){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE){
+        return;
+    }
+    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, t->root), min);
+    uint16_t index = kv_page_find_insert_index(leaf, min);
+    kv_tree_record* records = KV_TREE_RECORDS(leaf);
+    for(;;){
+        // the records move with the leaf, and a leaf may be empty in lazy mode
+        if(index >= leaf->record_num){
+            if(leaf->next_page == NULL_PAGE){
+                break;
+            }
+            leaf    = kv_page_at(kv, leaf->next_page);
+            records = KV_TREE_RECORDS(leaf);
+            index   = 0;
+            continue;
+        }
+        if(records[index].key >= max){
+            break;
+        }
+        callback(ptr, records[index].key, records[index+1].value);
+        ++index;
+    }
+}
+
+static void tree_iterate(kv_tree* t, void* ptr, void(*f)(void*, uint16_t, int64_t, int64_t)){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE){
+        return;
+    }
+    kv_tree_record *records;
+    kv_page* p = tree_leftmost_leaf(kv, t->root);
+
+    uint32_t page = p->page;
+    for(; page != NULL_PAGE;){
+        p = kv_page_at(kv, page);
+        records = KV_TREE_RECORDS(p);
+        for(uint16_t i=0; i<p->record_num; ++i){
+            f(ptr, page, records[i].key, records[i+1].value);
+        }
+        page = p->next_page;
+    }
+}
+
+static void kv_defer_rebalance(kv_tree* t, kv_page* leaf, int64_t key){
+    kv_file* kv = t->kv;
+    if(kv->pending_num > 0 && kv->pending[kv->pending_num-1].page == leaf->page){
+        return;
+    }
+    if(kv->pending_num >= kv->pending_cap){
+        kv->pending_cap = kv->pending_cap > 0 ? kv->pending_cap * 2 : 64;
+        kv->pending = (kv_pending*)realloc(kv->pending, sizeof(kv_pending) * kv->pending_cap);
+    }
+    // deleting the first key raises the separator in front of the leaf, the
+    // separator behind it only moves with its right sibling, so the last key
+    // keeps routing to the leaf
+    kv_tree_record* records = KV_TREE_RECORDS(leaf);
+    kv->pending[kv->pending_num].tree = t;
+    kv->pending[kv->pending_num].page = leaf->page;
+    kv->pending[kv->pending_num].key  = leaf->record_num > 0 ? records[leaf->record_num-1].key : key;
+    kv->pending_num += 1;
+}
+
+static int kv_pending_compare(const void* a, const void* b){
+    const kv_pending* l = (const kv_pending*)a;
+    const kv_pending* r = (const kv_pending*)b;
+    if(l->tree != r->tree){
+        return l->tree < r->tree ? -1 : 1;
+    }
+    return l->key < r->key ? -1 : (l->key > r->key ? 1 : 0);
+}
+
+static uint32_t tree_maintain(kv_file* kv){
+    // leaves may have been merged or split since they were deferred, so each
+    // one is found again by key, in key order to keep the descents local. a
+    // borrow moves one record and a merge of two underfull leaves may still be
+    // underfull, and a leaf that was an only child is left for its parent, so
+    // the path is rebalanced again until nothing on it changes
+    qsort(kv->pending, kv->pending_num, sizeof(kv_pending), kv_pending_compare);
+    uint32_t num = 0;
+    for(uint32_t i=0; i<kv->pending_num; ++i){
+        kv_tree* t = kv->pending[i].tree;
+        if(t->root == NULL_PAGE){
+            continue;
+        }
+        if(kv_rebalance_path(kv, &t->root, kv->pending[i].key)){
+            for(; t->root != NULL_PAGE && kv_rebalance_path(kv, &t->root, kv->pending[i].key);){
+            }
+            num += 1;
+        }
+    }
+    kv->pending_num = 0;
+    kv_dirty_flush(kv, false);
+    return num;
+}
+
+static kv_page* tree_leftmost_leaf(kv_file* kv, uint32_t page){
+    kv_page* p = kv_page_at(kv, page);
+    for(; p->type != KV_PAGE_DATA;){
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+        p = kv_page_at(kv, records[0].value);
+    }
+    return p;
+}
+
+// replace a level of page numbers with all of their children, page numbers are
+// kept instead of page pointers since loading a page may evict another one
+static uint32_t* tree_expand_level(kv_file* kv, uint32_t* level, uint32_t num, uint32_t* next_num){
+    uint32_t  cap  = 64;
+    uint32_t* next = (uint32_t*)malloc(sizeof(uint32_t) * cap);
+    *next_num = 0;
+    for(uint32_t n=0; n<num; ++n){
+        kv_page* p = kv_page_at(kv, level[n]);
+        if(p->type == KV_PAGE_DATA){
+            continue;
+        }
+
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+        for(uint16_t i=0; i<=p->record_num; ++i){
+            if(*next_num >= cap){
+                cap *= 2;
+                next = (uint32_t*)realloc(next, sizeof(uint32_t) * cap);
+            }
+            next[(*next_num)++] = records[i].value;
+        }
+    }
+    free(level);
+    return next;
+}
+
+// call f once per leaf with the index run [begin, end) of records whose key
+// lies in [min, max), records[i].key pairs with records[i+1].value
+static void kv_range_walk(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*f)(void*, kv_tree_record*, uint16_t, uint16_t)){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE || min >= max){
+        return;
+    }
+
+    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, t->root), min);
+    uint16_t begin = kv_page_find_insert_index(leaf, min);
+    for(;;){
+        kv_tree_record* records = KV_TREE_RECORDS(leaf);
+        uint16_t end = leaf->record_num;
+        bool last = false;
+        if(end > 0 && records[end-1].key >= max){
+            end  = kv_page_find_insert_index(leaf, max);
+            last = true;
+        }
+        if(begin < end){
+            f(ptr, records, begin, end);
+        }
+        if(last || leaf->next_page == NULL_PAGE){
+            break;
+        }
+        leaf  = kv_page_at(kv, leaf->next_page);
+        begin = 0;
+    }
+}
+
+// plain counted loops over the value column so the compiler can vectorize them
+static void kv_aggregate_span(void* ptr, kv_tree_record* records, uint16_t begin, uint16_t end){
+    kv_aggregate*   agg    = (kv_aggregate*)ptr;
+    kv_tree_record* values = records + 1;
+    uint16_t        n      = end - begin;
+
+    if(agg->ops & KV_AGG_SUM){
+        int64_t sum = 0;
+        for(uint16_t i=begin; i<end; ++i){
+            sum += values[i].value;
+        }
+        agg->sum += sum;
+    }
+    if(agg->ops & KV_AGG_MIN){
+        int64_t min = agg->count > 0 ? agg->min : INT64_MAX;
+        for(uint16_t i=begin; i<end; ++i){
+            min = values[i].value < min ? values[i].value : min;
+        }
+        agg->min = min;
+    }
+    if(agg->ops & KV_AGG_MAX){
+        int64_t max = agg->count > 0 ? agg->max : INT64_MIN;
+        for(uint16_t i=begin; i<end; ++i){
+            max = values[i].value > max ? values[i].value : max;
+        }
+        agg->max = max;
+    }
+    agg->count += n;
+}
+
+static void tree_range_aggregate(kv_tree* t, int64_t min, int64_t max, kv_aggregate* result){
+    kv_range_walk(t, min, max, result, kv_aggregate_span);
+}
+
+typedef struct __kv_span_ctx{
+    void*      ptr;
+    void       (*callback)(void*, const kv_span*);
+    kv_record* buf;
+}kv_span_ctx;
+
+// spans point into the leaf when it holds kv_record, narrower records are widened
+// into buf first
+static void kv_span_emit(void* ptr, kv_tree_record* records, uint16_t begin, uint16_t end){
+    kv_span_ctx* ctx = (kv_span_ctx*)ptr;
+#if KV_TREE_NATIVE
+    kv_span span = {
+        .keys   = &records[begin].key,
+        .values = &records[begin+1].value,
+        .count  = end - begin,
+        .stride = sizeof(kv_record) / sizeof(int64_t),
+    };
+#else
+    for(uint16_t i=begin; i<end; ++i){
+        ctx->buf[i-begin].key   = records[i].key;
+        ctx->buf[i-begin].value = records[i+1].value;
+    }
+    kv_span span = {
+        .keys   = &ctx->buf[0].key,
+        .values = &ctx->buf[0].value,
+        .count  = end - begin,
+        .stride = sizeof(kv_record) / sizeof(int64_t),
+    };
+#endif
+    ctx->callback(ctx->ptr, &span);
+}
+
+static void tree_range_spans(kv_tree* t, int64_t min, int64_t max, void* ptr, void (*callback)(void*, const kv_span*)){
+    kv_span_ctx ctx = {.ptr = ptr, .callback = callback, .buf = NULL};
+#if !KV_TREE_NATIVE
+    ctx.buf = (kv_record*)malloc(sizeof(kv_record) * t->kv->order);
+#endif
+    kv_range_walk(t, min, max, &ctx, kv_span_emit);
+    free(ctx.buf);
+}
+
+// copy at most num records of [min, max) to out in key order, a caller wanting
+// the rest goes on from the last key + 1, each call is one descent
+static uint32_t tree_range_copy(kv_tree* t, int64_t min, int64_t max, kv_record* out, uint32_t num){
+    kv_file* kv = t->kv;
+    if(t->root == NULL_PAGE || min >= max){
+        return 0;
+    }
+
+    kv_page* leaf  = kv_find_leaf_page(kv, kv_page_at(kv, t->root), min);
+    uint16_t index = kv_page_find_insert_index(leaf, min);
+    uint32_t n     = 0;
+    for(; n < num;){
+        if(index >= leaf->record_num){
+            if(leaf->next_page == NULL_PAGE){
+                break;
+            }
+            leaf  = kv_page_at(kv, leaf->next_page);
+            index = 0;
+            continue;
+        }
+        kv_tree_record* records = KV_TREE_RECORDS(leaf);
+        if(records[index].key >= max){
+            break;
+        }
+        out[n].key   = records[index].key;
+        out[n].value = records[index+1].value;
+        ++n;
+        ++index;
+    }
+    return n;
+}
+
+static void tree_page_set(kv_file*kv, kv_page* p, int64_t key, int64_t value){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t index = kv_page_find_insert_index(p, key);
+
+    if(index >= p->record_num || records[index].key != key){
+        kv_page_insert(kv, p, index, key, value);
+        return;
+    }
+    if(records[index+1].value == value){
+        return;
+    }
+    records[index+1].value = value;
+    kv_dirty_page(kv, p->page);
+}
+
+// insert a key missing from the leaf at its insert index
+static void kv_page_insert(kv_file* kv, kv_page* p, uint16_t index, int64_t key, int64_t value){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    for(uint16_t i=p->record_num; i>index; --i){
+        records[i].key = records[i-1].key;
+        records[i+1].value = records[i].value;
+    }
+    records[index].key   = key;
+    records[index+1].value = value;
+    p->record_num += 1;
+    kv_dirty_page(kv, p->page);
+}
+
+static kv_page* kv_split_page(kv_file* kv, kv_page* p){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t mid = kv->order / 2;
+    int64_t  mid_key = records[mid].key;
+    kv_page* new = kv_page_create(kv, p->type);
+    kv_tree_record* new_records = KV_TREE_RECORDS(new);
+    kv_page* parent = NULL;
+    if(p->parent != NULL_PAGE){
+        parent = kv_page_pin(kv, p->parent);
+        kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+        uint16_t index = kv_find_child_index(parent, records[0].key);
+        for(uint16_t i=parent->record_num; i>index; --i){
+            parent_records[i].key = parent_records[i-1].key;
+            parent_records[i+1].value = parent_records[i].value;
+        }
+
+        parent_records[index].key   = mid_key;
+        parent_records[index+1].value = new->page;
+        new->parent = parent->page;
+        parent->record_num += 1;
+    }else{
+        parent = kv_page_create(kv, KV_PAGE_NODE);
+        kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+        uint16_t index = 0;
+        parent_records[index].key = mid_key;
+        parent_records[index+1].value = new->page;
+        new->parent = parent->page;
+        parent->record_num += 1;
+
+        parent_records[index].value = p->page;
+        p->parent = parent->page;
+    }
+
+    if(p->type == KV_PAGE_DATA){
+        for(uint16_t i=mid; i<p->record_num; ++i){
+            new_records[i-mid].key = records[i].key;
+            new_records[i-mid+1].value = records[i+1].value;
+        }
+        new->record_num = p->record_num - mid;
+        p->record_num = mid;
+        new->next_page= p->next_page;
+        p->next_page = new->page;
+    }else{
+        for(uint16_t i=mid+1; i<p->record_num+1; ++i){
+            new_records[i-mid-1].key   = records[i].key;
+            new_records[i-mid-1].value = records[i].value;
+            kv_page_set_parent(kv, records[i].value, new->page);
+        }
+        new->record_num = p->record_num - mid - 1;
+        p->record_num = mid;
+    }
+
+    kv_dirty_page(kv, p->page);
+    kv_dirty_page(kv, new->page);
+    kv_dirty_page(kv, parent->page);
+    kv->stats.splits += 1;
+    kv->tree_version += 1;
+    return parent;
+}
+
+static void kv_page_split_if_need(kv_file* kv, uint32_t* root, kv_page* p){
+    if(p->record_num < kv->order) {
+        return;
+    }
+
+    bool is_root = (p->parent == NULL_PAGE);
+    TRACE_BEGIN(TRACE_SPLIT)
+    kv_page* parent = kv_split_page(kv, p);
+    TRACE_END()
+    if(is_root){
+        *root = parent->page;
+    }
+    kv_page_split_if_need(kv, root, parent);
+}
+
+// first record at or past key, above it when upper is set. keys are guessed by
+// interpolation between the ends of the range, which lands next to the answer when
+// they are spread evenly, and after KV_SEARCH_PROBES guesses binary search takes over
+static uint16_t kv_page_search(kv_page* p, int64_t key, bool upper){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t        left    = 0;
+    uint16_t        right   = p->record_num;
+    for(uint16_t probe=0; probe<KV_SEARCH_PROBES && right - left > KV_SEARCH_MIN_RANGE; ++probe){
+        int64_t lo = records[left].key;
+        int64_t hi = records[right-1].key;
+        if(KV_SEARCH_PAST(lo, key, upper)){
+            return left;
+        }
+        if(!KV_SEARCH_PAST(hi, key, upper)){
+            return right;
+        }
+
+        // lo < key <= hi, the answer is in [left + 1, right - 1]
+        double   frac = ((double)key - (double)lo) / ((double)hi - (double)lo);
+        uint16_t pos  = left + (uint16_t)(frac * (right - 1 - left));
+        left  += 1;
+        right -= 1;
+        pos    = pos < left ? left : (pos >= right ? right - 1 : pos);
+
+        // a second probe a gap away brackets the answer when the guess was close
+        if(KV_SEARCH_PAST(records[pos].key, key, upper)){
+            right = pos;
+            if(pos >= left + KV_SEARCH_GAP){
+                if(KV_SEARCH_PAST(records[pos - KV_SEARCH_GAP].key, key, upper)){
+                    right = pos - KV_SEARCH_GAP;
+                }else{
+                    left  = pos - KV_SEARCH_GAP + 1;
+                }
+            }
+        }else{
+            left = pos + 1;
+            if(pos + KV_SEARCH_GAP < right){
+                if(KV_SEARCH_PAST(records[pos + KV_SEARCH_GAP].key, key, upper)){
+                    right = pos + KV_SEARCH_GAP;
+                }else{
+                    left  = pos + KV_SEARCH_GAP + 1;
+                }
+            }
+        }
+    }
+
+    for(; left < right; ){
+        uint16_t mid = (left + right) / 2;
+        if(KV_SEARCH_PAST(records[mid].key, key, upper)){
+            right = mid;
+        }else{
+            left = mid + 1;
+        }
+    }
+    return left;
+}
+
+static uint16_t kv_page_find_insert_index(kv_page* p, int64_t key){
+    return kv_page_search(p, key, false);
+}
+
+// child i of a node holds keys in [records[i-1].key, records[i].key)
+static uint16_t kv_find_child_index(kv_page* p, int64_t key){
+    return kv_page_search(p, key, true);
+}
+
+static kv_page* kv_find_leaf_page(kv_file* kv, kv_page* p, int64_t key){
+    for(; p->type != KV_PAGE_DATA; ){
+        p = kv_page_at(kv, KV_TREE_RECORDS(p)[kv_find_child_index(p, key)].value);
+    }
+    return p;
+}
+
+// the leaf of the last put when key lies between its separators and nothing
+// reshaped the tree since, ascending keys keep landing on the rightmost leaf
+static kv_page* kv_hint_leaf(kv_tree* t, int64_t key){
+    kv_leaf_hint* h = &t->hint;
+    if(h->page == NULL_PAGE || h->version != t->kv->tree_version ||
+       (h->has_lo && key < h->lo) || (h->has_hi && key >= h->hi)){
+        return NULL;
+    }
+    t->kv->stats.hinted_puts += 1;
+    return kv_page_at(t->kv, h->page);
+}
+
+// descend like kv_find_leaf_page and keep the leaf with the tightest separators
+// seen on the way down as the hint of t
+static kv_page* kv_find_leaf_hinted(kv_tree* t, int64_t key){
+    kv_file*      kv = t->kv;
+    kv_leaf_hint* h  = &t->hint;
+    kv_page*      p  = kv_page_at(kv, t->root);
+    h->has_lo = false;
+    h->has_hi = false;
+    for(; p->type != KV_PAGE_DATA; ){
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+        uint16_t        index   = kv_find_child_index(p, key);
+        if(index > 0){
+            h->lo     = records[index-1].key;
+            h->has_lo = true;
+        }
+        if(index < p->record_num){
+            h->hi     = records[index].key;
+            h->has_hi = true;
+        }
+        p = kv_page_at(kv, records[index].value);
+    }
+    h->page    = p->page;
+    h->version = kv->tree_version;
+    return p;
+}
+
+static void kv_page_replace_min(kv_file* kv, kv_page* p, int64_t key){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    int64_t  min = records[0].key;
+    uint32_t parent_page = p->parent;
+    for( ;parent_page != NULL_PAGE; ){
+        kv_page* parent = kv_page_at(kv, parent_page);
+        kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+        uint16_t index = kv_find_child_index(parent, key);
+        if(index != 0 && parent_records[index-1].key == key){
+            parent_records[index-1].key = min;
+            kv->tree_version += 1;
+            kv_dirty_page(kv, parent->page);
+        }
+        parent_page = parent->parent;
+    }
+}
+
+static void kv_page_del(kv_file* kv, kv_page* p, int64_t key){
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t        index   = kv_page_find_insert_index(p, key);
+    if(index >= p->record_num || records[index].key != key){
+        return;
+    }
+
+    for(uint16_t i=index; i<p->record_num-1; ++i){
+        records[i].key = records[i+1].key;
+        records[i+1].value = records[i+2].value;
+    }
+    p->record_num -= 1;
+
+    // an emptied page keeps its separator, which still bounds it from below
+    if(p->parent != NULL_PAGE && index == 0 && p->record_num > 0){
+        kv_page_replace_min(kv, p, key);
+    }
+    kv_dirty_page(kv, p->page);
+}
+
+// slot of child page in parent, found by page number so that it also works
+// for pages emptied by deletes
+static uint16_t kv_find_child_slot(kv_page* parent, uint32_t page){
+    kv_tree_record* records = KV_TREE_RECORDS(parent);
+    for(uint16_t i=0; i<=parent->record_num; ++i){
+        if(records[i].value == page){
+            return i;
+        }
+    }
+    FATAL("page %u is not a child of page %u", page, parent->page);
+}
+
+static bool kv_page_should_get_record_from_left(kv_file*kv, kv_page* p){
+    kv_page*        parent = kv_page_pin(kv, p->parent);
+    kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+    uint16_t index  = kv_find_child_slot(parent, p->page);
+    if(index > 0){
+        kv_page* sibling = kv_page_at(kv, parent_records[index-1].value);
+        return sibling->record_num > kv->min_records;
+    }
+    return false;
+}
+
+static bool kv_page_should_get_record_from_right(kv_file*kv, kv_page* p){
+    kv_page*        parent = kv_page_pin(kv, p->parent);
+    kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+    uint16_t index  = kv_find_child_slot(parent, p->page);
+    if(index < parent->record_num){
+        kv_page* sibling = kv_page_at(kv, parent_records[index+1].value);
+        return sibling->record_num > kv->min_records;
+    }
+    return false;
+}
+
+static void kv_page_get_record_from_left(kv_file* kv, kv_page* p){
+    kv_page*        parent = kv_page_pin(kv, p->parent);
+    kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    uint16_t        index   = kv_find_child_slot(parent, p->page);
+    kv_page*        sibling = kv_page_pin(kv, parent_records[index-1].value);
+    kv_tree_record* sibling_records = KV_TREE_RECORDS(sibling);
+
+    for(uint16_t i=p->record_num; i>0; --i){
+        records[i].key     = records[i-1].key;
+        records[i+1].value = records[i].value;
+    }
+    p->record_num += 1;
+
+    if(p->type == KV_PAGE_DATA){
+        records[0].key   = sibling_records[sibling->record_num-1].key;
+        records[1].value = sibling_records[sibling->record_num].value;
+        parent_records[index-1].key = records[0].key;
+    }else{
+        records[1].value = records[0].value;
+        records[0].key   = parent_records[index-1].key;
+        records[0].value = sibling_records[sibling->record_num].value;
+        parent_records[index-1].key = sibling_records[sibling->record_num-1].key;
+        sibling_records[sibling->record_num].value = NULL_PAGE;
+        kv_page_set_parent(kv, records[0].value, p->page);
+    }
+    sibling->record_num -= 1;
+
+    kv_dirty_page(kv, p->page);
+    kv_dirty_page(kv, sibling->page);
+    kv_dirty_page(kv, parent->page);
+    kv->stats.borrows += 1;
+    kv->tree_version += 1;
+}
+
+static void kv_page_get_record_from_right(kv_file* kv, kv_page* p){
+    kv_page*        parent = kv_page_pin(kv, p->parent);
+    kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+
+    p->record_num += 1;
+    uint16_t index  = kv_find_child_slot(parent, p->page);
+    kv_page*        sibling = kv_page_pin(kv, parent_records[index+1].value);
+    kv_tree_record* sibling_records = KV_TREE_RECORDS(sibling);
+    if(p->type == KV_PAGE_DATA){
+        records[p->record_num-1].key = sibling_records[0].key;
+        records[p->record_num].value = sibling_records[1].value;
+        parent_records[index].key = sibling_records[1].key;
+    }else{
+        records[p->record_num-1].key = parent_records[index].key;
+        parent_records[index].key = sibling_records[0].key;
+        records[p->record_num].value = sibling_records[0].value;
+        kv_page_set_parent(kv, records[p->record_num].value, p->page);
+    }
+
+    for(uint16_t i=1; i<sibling->record_num; ++i){
+        sibling_records[i-1].key   = sibling_records[i].key;
+        sibling_records[i-1].value = sibling_records[i].value;
+    }
+    sibling_records[sibling->record_num-1].value = sibling_records[sibling->record_num].value;
+    sibling->record_num -= 1;
+
+    kv_dirty_page(kv, p->page);
+    kv_dirty_page(kv, sibling->page);
+    kv_dirty_page(kv, parent->page);
+    kv->stats.borrows += 1;
+    kv->tree_version += 1;
+}
+
+static kv_page* kv_page_merge_sibling(kv_file* kv, kv_page* left, kv_page*right){
+    kv_page*        parent = kv_page_pin(kv, left->parent);
+    kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+    kv_tree_record* left_records   = KV_TREE_RECORDS(left);
+    kv_tree_record* right_records  = KV_TREE_RECORDS(right);
+    uint16_t        index = kv_find_child_slot(parent, left->page);
+
+    if(left->type == KV_PAGE_DATA){
+        for(uint16_t i=0; i<right->record_num; ++i){
+            left_records[left->record_num+i].key = right_records[i].key;
+            left_records[left->record_num+i+1].value = right_records[i+1].value;
+        }
+        left->record_num += right->record_num;
+        left->next_page   = right->next_page;
+    }else{
+        left_records[left->record_num].key = parent_records[index].key;
+        left_records[left->record_num+1].value = right_records[0].value;
+        kv_page_set_parent(kv, right_records[0].value, left->page);
+        left->record_num += 1;
+        for(uint16_t i=0; i<right->record_num; ++i){
+            left_records[left->record_num+i].key = right_records[i].key;
+            left_records[left->record_num+i+1].value = right_records[i+1].value;
+            kv_page_set_parent(kv, right_records[i+1].value, left->page);
+        }
+        left->record_num += right->record_num;
+    }
+
+    for(uint16_t i=index; i<parent->record_num-1; ++i){
+        parent_records[i].key     = parent_records[i+1].key;
+        parent_records[i+1].value = parent_records[i+2].value;
+    }
+    parent->record_num -= 1;
+
+    kv_dirty_page(kv, left->page);
+    kv_dirty_page(kv, parent->page);
+    kv_page_free(kv, right);
+    kv->stats.merges += 1;
+    kv->tree_version += 1;
+    return parent;
+}
+
+static void kv_page_merge_if_need(kv_file* kv, uint32_t* root, kv_page* p){
+    if(p->record_num >= kv->min_records){
+        return;
+    }
+
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    if(p->parent == NULL_PAGE){
+        if(p->record_num > 0){
+            return;
+        }
+        // an empty root node is replaced by its only child, an empty root leaf empties the tree
+        if(p->type == KV_PAGE_NODE){
+            *root = records[0].value;
+            kv_page_set_parent(kv, *root, NULL_PAGE);
+        }else{
+            *root = NULL_PAGE;
+        }
+        kv_page_free(kv, p);
+        return;
+    }
+    // the only child of a parent has no sibling, it is rebalanced after the parent
+    if(kv_page_pin(kv, p->parent)->record_num == 0){
+        return;
+    }
+
+    TRACE_BEGIN(TRACE_MERGE)
+    if(kv_page_should_get_record_from_left(kv, p)){
+        kv_page_get_record_from_left(kv, p);
+        TRACE_END()
+    }else if(kv_page_should_get_record_from_right(kv, p)){
+        kv_page_get_record_from_right(kv, p);
+        TRACE_END()
+    }else{
+        kv_page*        parent = kv_page_pin(kv, p->parent);
+        kv_tree_record* parent_records = KV_TREE_RECORDS(parent);
+        uint16_t index  = kv_find_child_slot(parent, p->page);
+        kv_page*        sibling = NULL;
+        if(index < parent->record_num){
+            sibling = kv_page_pin(kv, parent_records[index+1].value);
+            parent = kv_page_merge_sibling(kv, p, sibling);
+        }else{
+            sibling = kv_page_pin(kv, parent_records[index-1].value);
+            parent  = kv_page_merge_sibling(kv, sibling, p);
+        }
+        TRACE_END()
+        kv_page_merge_if_need(kv, root, parent);
+    }
+}
+
+static void kv_print_pages(kv_file* kv, kv_page** pages, uint16_t page_num, uint16_t level){
+    char fmt[16] = {0};
+    uint16_t begin = 60 - level * 10;
+    sprintf(fmt, "%%%ds", begin);
+    printf(fmt, " ");
+
+    kv_page* child[16] = {0};
+    uint16_t child_num = 0;
+
+    for(uint16_t n=0; n<page_num; ++n) {
+        kv_page* p = pages[n];
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+
+        printf("    <%d>", p->page);
+        if (p->type == KV_PAGE_DATA) {
+            for (uint16_t i = 0; i < p->record_num; ++i) {
+                printf("(%ld)%ld", (int64_t)records[i].value, (int64_t)records[i].key);
+            }
+            printf("(%ld)", (int64_t)records[p->record_num].value);
+        } else {
+            for (uint16_t i = 0; i < p->record_num; ++i) {
+                printf("(%ld)%ld", (int64_t)records[i].value, (int64_t)records[i].key);
+                child[child_num] = kv_page_at(kv, records[i].value);
+                child_num += 1;
+            }
+            printf("(%ld)", (int64_t)records[p->record_num].value);
+            child[child_num] = kv_page_at(kv, records[p->record_num].value);
+            child_num += 1;
+        }
+    }
+    printf("\n");
+    if(child_num > 0){
+        kv_print_pages(kv, child, child_num, level+1);
+    }
+}
+
+static void tree_print(kv_file* kv){
+    if(kv->main.root == NULL_PAGE){
+        return;
+    }
+
+    kv_page* pages[1] = {kv_page_at(kv, kv->main.root)};
+    kv_print_pages(kv, pages, 1, 0);
+}
+
+// records of a tree that is not empty, widened to kv_record
+static int tree_dump(kv_tree* t, int fd){
+    kv_file*   kv  = t->kv;
+    int        ret = CODE_SUCCEED;
+    kv_record* out = (kv_record*)malloc(sizeof(kv_record) * (KV_DUMP_BATCH + kv->order));
+    uint32_t   num = 0;
+    for(uint32_t page = tree_leftmost_leaf(kv, t->root)->page; page != NULL_PAGE && ret == CODE_SUCCEED;){
+        kv_page*        p       = kv_page_at(kv, page);
+        kv_tree_record* records = KV_TREE_RECORDS(p);
+        for(uint16_t i=0; i<p->record_num; ++i, ++num){
+            out[num].key   = records[i].key;
+            out[num].value = records[i+1].value;
+        }
+        page = p->next_page;
+        if(page == NULL_PAGE || num >= KV_DUMP_BATCH){
+            ret = kv_write_full(fd, out, sizeof(kv_record) * num);
+            num = 0;
+        }
+    }
+    free(out);
+    return ret;
+}
+
+typedef struct __kv_load_entry{
+    uint32_t page;
+    int64_t  key;
+}kv_load_entry;
+
+// builds an empty tree bottom up from keys in ascending order. every level keeps
+// up to two pages worth of entries back, so its last page can take half of them
+// and is never underfull
+typedef struct __kv_loader{
+    kv_tree*       tree;
+    int64_t        last;
+    bool           has_last;
+    kv_record*     records;
+    uint32_t       record_num;
+    uint32_t       prev_leaf;
+    kv_load_entry* children[KV_MAX_HEIGHT];
+    uint32_t       child_num[KV_MAX_HEIGHT];
+    uint32_t       built[KV_MAX_HEIGHT];
+}kv_loader;
+
+static void kv_loader_push(kv_loader* ld, uint16_t level, uint32_t page, int64_t key);
+
+// build a node at level + 1 from the first num pages of level
+static void kv_loader_node(kv_loader* ld, uint16_t level, uint32_t num){
+    kv_file*        kv       = ld->tree->kv;
+    kv_load_entry*  children = ld->children[level];
+    kv_page*        p        = kv_page_create(kv, KV_PAGE_NODE);
+    uint32_t        page     = p->page;
+    kv_tree_record* records  = KV_TREE_RECORDS(p);
+    records[0].value = children[0].page;
+    for(uint32_t i=1; i<num; ++i){
+        records[i-1].key = children[i].key;
+        records[i].value = children[i].page;
+    }
+    p->record_num = num - 1;
+    kv_dirty_page(kv, page);
+    kv_unpin_all(kv);
+
+    for(uint32_t i=0; i<num; ++i){
+        kv_page_set_parent(kv, children[i].page, page);
+    }
+    int64_t key = children[0].key;
+    ld->child_num[level] -= num;
+    memmove(children, children + num, sizeof(kv_load_entry) * ld->child_num[level]);
+    kv_loader_push(ld, level + 1, page, key);
+}
+
+static void kv_loader_push(kv_loader* ld, uint16_t level, uint32_t page, int64_t key){
+    if(level + 1 >= KV_MAX_HEIGHT){
+        FATAL("bulk load tree is too high");
+    }
+    if(ld->children[level] == NULL){
+        ld->children[level] = (kv_load_entry*)malloc(sizeof(kv_load_entry) * 2 * KV_LOAD_NODE_CHILDREN(ld->tree->kv));
+    }
+    kv_load_entry* e = ld->children[level] + ld->child_num[level]++;
+    e->page = page;
+    e->key  = key;
+    ld->built[level] += 1;
+    if(ld->child_num[level] >= 2 * KV_LOAD_NODE_CHILDREN(ld->tree->kv)){
+        kv_loader_node(ld, level, KV_LOAD_NODE_CHILDREN(ld->tree->kv));
+    }
+}
+
+// build a leaf from the first num buffered records and chain it after the last one
+static void kv_loader_leaf(kv_loader* ld, uint32_t num){
+    kv_file*        kv      = ld->tree->kv;
+    kv_page*        p       = kv_page_create(kv, KV_PAGE_DATA);
+    uint32_t        page    = p->page;
+    kv_tree_record* records = KV_TREE_RECORDS(p);
+    for(uint32_t i=0; i<num; ++i){
+        records[i].key     = ld->records[i].key;
+        records[i+1].value = ld->records[i].value;
+    }
+    p->record_num = num;
+    kv_dirty_page(kv, page);
+    if(ld->prev_leaf != NULL_PAGE){
+        kv_page_at(kv, ld->prev_leaf)->next_page = page;
+        kv_dirty_page(kv, ld->prev_leaf);
+    }
+    kv_unpin_all(kv);
+
+    int64_t key = ld->records[0].key;
+    ld->record_num -= num;
+    memmove(ld->records, ld->records + num, sizeof(kv_record) * ld->record_num);
+    ld->prev_leaf = page;
+    kv_loader_push(ld, 0, page, key);
+    kv_dirty_flush(kv, false);
+}
+
+static void kv_loader_add(kv_loader* ld, int64_t key, int64_t value){
+    kv_record* r = ld->records + ld->record_num++;
+    r->key       = key;
+    r->value     = value;
+    ld->last     = key;
+    ld->has_last = true;
+    if(ld->record_num >= 2 * KV_LOAD_LEAF_RECORDS(ld->tree->kv)){
+        kv_loader_leaf(ld, KV_LOAD_LEAF_RECORDS(ld->tree->kv));
+    }
+}
+
+// build the pages left on every level and make the single top page the root
+static void kv_loader_finish(kv_loader* ld){
+    if(ld->record_num > KV_LOAD_LEAF_RECORDS(ld->tree->kv)){
+        kv_loader_leaf(ld, ld->record_num / 2);
+    }
+    if(ld->record_num > 0){
+        kv_loader_leaf(ld, ld->record_num);
+    }
+
+    for(uint16_t level=0; ld->child_num[level] > 0; ++level){
+        uint32_t num = ld->child_num[level];
+        if(num == 1 && ld->built[level+1] == 0){
+            ld->tree->root = ld->children[level][0].page;
+            break;
+        }
+        if(num > KV_LOAD_NODE_CHILDREN(ld->tree->kv)){
+            kv_loader_node(ld, level, num / 2);
+        }
+        kv_loader_node(ld, level, ld->child_num[level]);
+    }
+
+    free(ld->records);
+    for(uint16_t level=0; level<KV_MAX_HEIGHT; ++level){
+        free(ld->children[level]);
+    }
+    kv_dirty_flush(ld->tree->kv, false);
+}
+
+// the records of a dump stream after its header, ones the layout can't store are
+// skipped and reported with CODE_INVALID_PARAMETER at the end
+static int tree_load(kv_tree* t, int fd){
+    size_t     got     = 0;
+    int        ret     = CODE_SUCCEED;
+    bool       skipped = false;
+    kv_loader* ld      = NULL;
+    if(t->root == NULL_PAGE){
+        ld = (kv_loader*)calloc(1, sizeof(kv_loader));
+        ld->tree      = t;
+        ld->records   = (kv_record*)malloc(sizeof(kv_record) * 2 * KV_LOAD_LEAF_RECORDS(t->kv));
+        ld->prev_leaf = NULL_PAGE;
+    }
+
+    kv_record* in = (kv_record*)malloc(sizeof(kv_record) * KV_DUMP_BATCH);
+    for(;;){
+        ret = kv_read_full(fd, in, sizeof(kv_record) * KV_DUMP_BATCH, &got);
+        if(ret != CODE_SUCCEED){
+            break;
+        }
+        if(got % sizeof(kv_record) != 0){
+            ret = CODE_CORRUPTED;
+        }
+        for(size_t i=0; i<got / sizeof(kv_record); ++i){
+            if(!KV_TREE_FITS(in[i].key, in[i].value)){
+                skipped = true;
+                continue;
+            }
+            if(ld != NULL && (!ld->has_last || in[i].key > ld->last)){
+                kv_loader_add(ld, in[i].key, in[i].value);
+                continue;
+            }
+            if(ld != NULL){
+                kv_loader_finish(ld);
+                free(ld);
+                ld = NULL;
+            }
+            tree_put(t, in[i].key, in[i].value);
+        }
+        if(got < sizeof(kv_record) * KV_DUMP_BATCH){
+            break;
+        }
+    }
+
+    if(ld != NULL){
+        kv_loader_finish(ld);
+        free(ld);
+    }
+    free(in);
+    return ret == CODE_SUCCEED && skipped ? CODE_INVALID_PARAMETER : ret;
+}
+
+#if !KV_TREE_NATIVE
+// widen the records of a page in place of kv_record, for scan and check
+static void tree_unpack(const kv_page* p, kv_record* records){
+    const kv_tree_record* in = KV_TREE_RECORDS(p);
+    for(uint16_t i=0; i<=p->record_num; ++i){
+        records[i].key   = i < p->record_num ? in[i].key : 0;
+        records[i].value = in[i].value;
+    }
+}
+#endif
+
+const kv_layout KV_TREE_LAYOUT = {
+    .id              = KV_TREE_LAYOUT_ID,
+    .key_bits        = KV_KEY_BITS,
+    .value_bits      = KV_VALUE_BITS,
+    .record_size     = sizeof(kv_tree_record),
+    .put             = tree_put,
+    .get             = tree_get,
+    .del             = tree_del,
+    .del_range       = tree_del_range,
+    .update          = tree_update,
+    .next            = tree_next,
+    .range           = tree_range,
+    .range_spans     = tree_range_spans,
+    .range_copy      = tree_range_copy,
+    .range_aggregate = tree_range_aggregate,
+    .iterate         = tree_iterate,
+    .apply_batch     = tree_apply_batch,
+    .maintain        = tree_maintain,
+    .page_set        = tree_page_set,
+    .leftmost_leaf   = tree_leftmost_leaf,
+    .expand_level    = tree_expand_level,
+    .print           = tree_print,
+    .dump            = tree_dump,
+    .load            = tree_load,
+#if KV_TREE_NATIVE
+    .unpack          = NULL,
+#else
+    .unpack          = tree_unpack,
+#endif
+};
+
+#endif//__KV_TREE_H__
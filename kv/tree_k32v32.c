@@ -0,0 +1,6 @@
+// 32 bit keys and 32 bit values
+#define KV_KEY_BITS       32
+#define KV_VALUE_BITS     32
+#define KV_TREE_LAYOUT    kv_layout_k32v32
+#define KV_TREE_LAYOUT_ID KV_LAYOUT_K32V32
+#include "tree.h"
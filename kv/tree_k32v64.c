@@ -0,0 +1,6 @@
+// 32 bit keys and 64 bit values
+#define KV_KEY_BITS       32
+#define KV_VALUE_BITS     64
+#define KV_TREE_LAYOUT    kv_layout_k32v64
+#define KV_TREE_LAYOUT_ID KV_LAYOUT_K32V64
+#include "tree.h"
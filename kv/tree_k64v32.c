@@ -0,0 +1,6 @@
+// 64 bit keys and 32 bit values
+#define KV_KEY_BITS       64
+#define KV_VALUE_BITS     32
+#define KV_TREE_LAYOUT    kv_layout_k64v32
+#define KV_TREE_LAYOUT_ID KV_LAYOUT_K64V32
+#include "tree.h"
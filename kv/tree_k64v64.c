@@ -0,0 +1,6 @@
+// 64 bit keys and 64 bit values
+#define KV_KEY_BITS       64
+#define KV_VALUE_BITS     64
+#define KV_TREE_LAYOUT    kv_layout_k64v64
+#define KV_TREE_LAYOUT_ID KV_LAYOUT_K64V64
+#include "tree.h"
@@ -0,0 +1,468 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "log.h"
+#include "kv.h"
+#include "kvd.h"
+
+#if KVD_OP_GET != KV_OP_GET || KVD_OP_PUT != KV_OP_PUT || KVD_OP_DEL != KV_OP_DEL
+#error "kvd ops must match kv ops"
+#endif
+#if KVD_STATUS_INVALID != CODE_INVALID_PARAMETER || KVD_STATUS_NOT_EXIST != CODE_KEY_NOT_EXIST
+#error "kvd status must match kv codes"
+#endif
+
+#define KVD_NAME "test.kdb"
+#define KVD_MAX_EVENTS 256
+// room for two full explicit batches, so one is never split by the buffer end
+#define KVD_IN_FRAMES  (2 * (KVD_BATCH_MAX + 1))
+// a connection is not read while more than this is waiting to be sent
+#define KVD_OUT_HIGH   (4 * 1024 * 1024)
+// records a range copies out of the engine at a time
+#define KVD_RANGE_ROWS 4096
+// flush dirty pages after this long without requests
+#define KVD_IDLE_MSEC  1000
+
+typedef struct __kvd_conn{
+    int      fd;
+    bool     listener;
+    uint32_t events;
+    uint8_t* in;
+    uint32_t in_len;
+    uint8_t* out;
+    size_t   out_pos;
+    size_t   out_len;
+    size_t   out_cap;
+    // a range stopped by a full output buffer, later requests wait behind it
+    bool     ranging;
+    uint32_t range_id;
+    int64_t  range_next;
+    int64_t  range_max;
+    int64_t  range_count;
+}kvd_conn;
+
+kv_file* kvd_db    = NULL;
+int      kvd_epoll = -1;
+kv_op    kvd_ops[KVD_BATCH_MAX];
+kv_record kvd_rows[KVD_RANGE_ROWS];
+volatile sig_atomic_t kvd_stop = 0;
+
+void kvd_help(){
+    printf("kvd --help               -- show help\r\n"
+           "kvd --file <db>          -- database file, test.kdb by default\r\n"
+           "kvd --mem                -- serve a temporary database in memory\r\n"
+           "kvd --unix <path>        -- listen on unix domain socket path\r\n"
+           "kvd --port <port>        -- listen on 127.0.0.1:port, 7380 without --unix\r\n"
+           "kvd --cache <pages>      -- cache size in pages\r\n"
+           "kvd --page-size <bytes>  -- page size of a new database, 4096 to 65536\r\n"
+           "kvd --widths <key:value> -- key and value bits of a new database, 32 or 64\r\n"
+           "kvd --lazy               -- defer rebalancing after deletes\r\n");
+}
+
+void kvd_signal(int sig){
+    kvd_stop = 1;
+}
+
+void kvd_set_events(kvd_conn* c, uint32_t events){
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    if(epoll_ctl(kvd_epoll, EPOLL_CTL_MOD, c->fd, &ev) != 0){
+        FATAL("epoll mod %d failed with errno: %d", c->fd, errno);
+    }
+}
+
+void kvd_close_conn(kvd_conn* c){
+    epoll_ctl(kvd_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+kvd_response* kvd_response_at(kvd_conn* c){
+    // move what is still unsent to the front before growing
+    if(c->out_len + sizeof(kvd_response) > c->out_cap && c->out_pos > 0){
+        memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+        c->out_len -= c->out_pos;
+        c->out_pos  = 0;
+    }
+    if(c->out_len + sizeof(kvd_response) > c->out_cap){
+        c->out_cap = c->out_cap > 0 ? c->out_cap * 2 : 64 * 1024;
+        c->out = (uint8_t*)realloc(c->out, c->out_cap);
+    }
+    kvd_response* r = (kvd_response*)(c->out + c->out_len);
+    c->out_len += sizeof(kvd_response);
+    memset(r->reserved, 0, sizeof(r->reserved));
+    return r;
+}
+
+void kvd_respond(kvd_conn* c, uint8_t status, uint32_t id, int64_t key, int64_t value){
+    kvd_response* r = kvd_response_at(c);
+    r->status = status;
+    r->id     = id;
+    r->key    = key;
+    r->value  = value;
+}
+
+void kvd_apply(kvd_conn* c, kvd_request* reqs, uint32_t num){
+    for(uint32_t i=0; i<num; ++i){
+        kvd_ops[i].type  = reqs[i].op;
+        kvd_ops[i].key   = reqs[i].key;
+        kvd_ops[i].value = reqs[i].value;
+    }
+    kv_apply_batch(kvd_db, kvd_ops, num);
+    for(uint32_t i=0; i<num; ++i){
+        kvd_respond(c, (uint8_t)kvd_ops[i].ret, reqs[i].id, kvd_ops[i].key, kvd_ops[i].value);
+    }
+}
+
+// send rows of the current range until it ends or the output buffer is full,
+// false if the range has to go on once the client has read some
+bool kvd_range_step(kvd_conn* c){
+    for(; c->out_len - c->out_pos < KVD_OUT_HIGH;){
+        uint32_t n = kv_range_copy(kvd_db, c->range_next, c->range_max, kvd_rows, KVD_RANGE_ROWS);
+        for(uint32_t i=0; i<n; ++i){
+            kvd_respond(c, KVD_STATUS_ROW, c->range_id, kvd_rows[i].key, kvd_rows[i].value);
+        }
+        c->range_count += n;
+        if(n < KVD_RANGE_ROWS){
+            kvd_respond(c, KVD_STATUS_OK, c->range_id, c->range_count, 0);
+            c->ranging = false;
+            return true;
+        }
+        // keys are below range_max, so the last one is never INT64_MAX
+        c->range_next = kvd_rows[n-1].key + 1;
+    }
+    return false;
+}
+
+bool kvd_is_single(uint8_t op){
+    return op == KVD_OP_GET || op == KVD_OP_PUT || op == KVD_OP_DEL;
+}
+
+// run all complete requests in the input buffer, runs of get/put/del become one
+// engine batch. an explicit batch waits until all of its requests have arrived
+void kvd_process(kvd_conn* c){
+    if(c->ranging && !kvd_range_step(c)){
+        return;
+    }
+
+    kvd_request* reqs = (kvd_request*)c->in;
+    uint32_t     num  = c->in_len / sizeof(kvd_request);
+    uint32_t     i    = 0;
+    while(i < num){
+        kvd_request* r = reqs + i;
+        if(r->op == KVD_OP_RANGE){
+            c->ranging     = true;
+            c->range_id    = r->id;
+            c->range_next  = r->key;
+            c->range_max   = r->value;
+            c->range_count = 0;
+            ++i;
+            if(!kvd_range_step(c)){
+                break;
+            }
+            continue;
+        }
+
+        if(r->op == KVD_OP_BATCH){
+            if(r->key < 0 || r->key > KVD_BATCH_MAX){
+                kvd_respond(c, KVD_STATUS_INVALID, r->id, r->key, 0);
+                ++i;
+                continue;
+            }
+            uint32_t n = (uint32_t)r->key;
+            if(i + 1 + n > num){
+                break;
+            }
+            for(uint32_t j=i+1; j<i+1+n; ++j){
+                if(!kvd_is_single(reqs[j].op)){
+                    reqs[j].op = 0;
+                }
+            }
+            kvd_apply(c, reqs + i + 1, n);
+            i += 1 + n;
+            continue;
+        }
+
+        if(!kvd_is_single(r->op)){
+            kvd_respond(c, KVD_STATUS_INVALID, r->id, r->key, r->value);
+            ++i;
+            continue;
+        }
+        uint32_t j = i + 1;
+        for(; j<num && j-i<KVD_BATCH_MAX && kvd_is_single(reqs[j].op); ++j){
+        }
+        kvd_apply(c, r, j - i);
+        i = j;
+    }
+
+    c->in_len -= i * sizeof(kvd_request);
+    memmove(c->in, c->in + i * sizeof(kvd_request), c->in_len);
+}
+
+// send what is pending, false if the connection failed
+bool kvd_send(kvd_conn* c){
+    for(; c->out_pos < c->out_len;){
+        ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            break;
+        }
+        if(n <= 0){
+            return false;
+        }
+        c->out_pos += n;
+    }
+    if(c->out_pos == c->out_len){
+        c->out_pos = 0;
+        c->out_len = 0;
+    }
+
+    // stop reading a client that doesn't read its responses
+    uint32_t events = c->out_len - c->out_pos < KVD_OUT_HIGH ? EPOLLIN : 0;
+    if(c->out_len > 0){
+        events |= EPOLLOUT;
+    }
+    if(events != c->events){
+        c->events = events;
+        kvd_set_events(c, events);
+    }
+    return true;
+}
+
+// false if the connection was closed
+bool kvd_receive(kvd_conn* c){
+    size_t  room = KVD_IN_FRAMES * sizeof(kvd_request) - c->in_len;
+    if(room == 0){
+        return true;
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, room);
+    if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
+        return true;
+    }
+    if(n <= 0){
+        return false;
+    }
+    c->in_len += n;
+    kvd_process(c);
+    return true;
+}
+
+void kvd_add(int fd, bool listener){
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0){
+        FATAL("set nonblocking %d failed with errno: %d", fd, errno);
+    }
+    kvd_conn* c = (kvd_conn*)calloc(1, sizeof(kvd_conn));
+    c->fd       = fd;
+    c->listener = listener;
+    c->events   = EPOLLIN;
+    if(!listener){
+        c->in = (uint8_t*)malloc(KVD_IN_FRAMES * sizeof(kvd_request));
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if(epoll_ctl(kvd_epoll, EPOLL_CTL_ADD, fd, &ev) != 0){
+        FATAL("epoll add %d failed with errno: %d", fd, errno);
+    }
+}
+
+void kvd_accept(kvd_conn* l){
+    for(;;){
+        int fd = accept(l->fd, NULL, NULL);
+        if(fd < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                WARN("accept failed with errno: %d", errno);
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        kvd_add(fd, false);
+    }
+}
+
+int kvd_listen_unix(const char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        FATAL("unix socket path %s is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0){
+        FATAL("listen on %s failed with errno: %d", path, errno);
+    }
+    return fd;
+}
+
+int kvd_listen_tcp(uint16_t port){
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd  = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0){
+        FATAL("listen on 127.0.0.1:%u failed with errno: %d", port, errno);
+    }
+    return fd;
+}
+
+void kvd_loop(){
+    struct epoll_event events[KVD_MAX_EVENTS];
+    bool idle = true;
+    for(; !kvd_stop;){
+        int n = epoll_wait(kvd_epoll, events, KVD_MAX_EVENTS, KVD_IDLE_MSEC);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            FATAL("epoll wait failed with errno: %d", errno);
+        }
+        if(n == 0){
+            if(!idle){
+                kv_flush(kvd_db);
+                idle = true;
+            }
+            continue;
+        }
+
+        idle = false;
+        for(int i=0; i<n; ++i){
+            kvd_conn* c = (kvd_conn*)events[i].data.ptr;
+            if(c->listener){
+                kvd_accept(c);
+                continue;
+            }
+            bool ok = true;
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                ok = kvd_receive(c);
+            }
+            if(ok){
+                ok = kvd_send(c);
+            }
+            // a range waiting for room goes on, and with it the requests behind it
+            for(; ok && c->ranging && c->out_len - c->out_pos < KVD_OUT_HIGH;){
+                kvd_process(c);
+                ok = kvd_send(c);
+            }
+            if(!ok){
+                kvd_close_conn(c);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    static struct option long_options[] = {
+            {"help",  no_argument,       NULL, 'h'},
+            {"file",  required_argument, NULL, 'f'},
+            {"mem",   no_argument,       NULL, 'm'},
+            {"unix",  required_argument, NULL, 'u'},
+            {"port",  required_argument, NULL, 'p'},
+            {"cache", required_argument, NULL, 'C'},
+            {"page-size", required_argument, NULL, 'P'},
+            {"widths", required_argument, NULL, 'W'},
+            {"lazy",  no_argument,       NULL, 'z'},
+            {0,       0,                 0,     0 }
+    };
+
+    kv_options options;
+    kv_options_init(&options);
+    const char* name = KVD_NAME;
+    const char* path = NULL;
+    int         port = -1;
+
+    int opt;
+    int option_index = 0;
+    while((opt=getopt_long(argc, argv, "", long_options, &option_index)) != -1){
+        switch(opt){
+            case 'h':
+                kvd_help();
+                return 0;
+            case 'f':
+                name = optarg;
+                break;
+            case 'm':
+                name = NULL;
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'C':
+                options.cache_pages = atoi(optarg) < 16 ? 16 : atoi(optarg);
+                break;
+            case 'P':
+                options.page_size = (uint32_t)atoi(optarg);
+                break;
+            case 'W':
+                if(sscanf(optarg, "%hhu:%hhu", &options.key_bits, &options.value_bits) != 2){
+                    kvd_help();
+                    return 1;
+                }
+                break;
+            case 'z':
+                options.lazy_delete = true;
+                break;
+            default:
+                kvd_help();
+                return 1;
+        }
+    }
+    if(path == NULL && port < 0){
+        port = KVD_DEFAULT_PORT;
+    }
+
+    kvd_db = kv_open_ex(name, &options);
+    // replace the flush-only handler of kv_open, kv_close flushes on the way out
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kvd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    kvd_epoll = epoll_create1(0);
+    if(kvd_epoll < 0){
+        FATAL("epoll create failed with errno: %d", errno);
+    }
+    if(path != NULL){
+        kvd_add(kvd_listen_unix(path), true);
+        INFO("kvd listen on %s", path);
+    }
+    if(port >= 0){
+        kvd_add(kvd_listen_tcp((uint16_t)port), true);
+        INFO("kvd listen on 127.0.0.1:%d", port);
+    }
+
+    kvd_loop();
+
+    INFO("kvd stopping");
+    kv_close(kvd_db);
+    if(path != NULL){
+        unlink(path);
+    }
+    log_flush();
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __KVD_H__
+#define __KVD_H__
+#include <stdint.h>
+
+// every request and response is one fixed size frame, so clients can pipeline
+// any number of requests and match responses by id, responses come in request order
+#define KVD_OP_GET   1
+#define KVD_OP_PUT   2
+#define KVD_OP_DEL   3
+// key is the min and value the max, one KVD_STATUS_ROW response per record in
+// [min, max) followed by a KVD_STATUS_OK response whose key is the record count.
+// rows are read in chunks as the client takes them, so a wide range may see writes
+// made by other connections meanwhile
+#define KVD_OP_RANGE 4
+// key is the number of get/put/del requests following it that are applied as one
+// engine batch, the batch frame itself has no response
+#define KVD_OP_BATCH 5
+
+#define KVD_STATUS_OK        0
+#define KVD_STATUS_INVALID   1
+#define KVD_STATUS_NOT_EXIST 2
+#define KVD_STATUS_ROW       0x80
+
+#define KVD_DEFAULT_PORT 7380
+#define KVD_BATCH_MAX    4096
+
+#pragma pack(1)
+typedef struct __kvd_request{
+    uint8_t  op;
+    uint8_t  reserved[3];
+    uint32_t id;
+    int64_t  key;
+    int64_t  value;
+}kvd_request;
+
+typedef struct __kvd_response{
+    uint8_t  status;
+    uint8_t  reserved[3];
+    uint32_t id;
+    int64_t  key;
+    int64_t  value;
+}kvd_response;
+#pragma pack()
+
+#endif//__KVD_H__
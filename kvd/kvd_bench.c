@@ -0,0 +1,234 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "kvd.h"
+
+#define BENCH_MAX_THREADS 256
+
+typedef struct __bench_worker{
+    pthread_t tid;
+    uint32_t  seed;
+    uint64_t  done;
+    uint64_t  errors;
+    uint64_t  round_usec_max;
+}bench_worker;
+
+const char* bench_path     = NULL;
+int         bench_port     = KVD_DEFAULT_PORT;
+uint32_t    bench_threads  = 4;
+uint32_t    bench_depth    = 64;
+uint64_t    bench_requests = 1000000;
+uint32_t    bench_reads    = 50;
+int64_t     bench_keys     = 1000000;
+bool        bench_batch    = false;
+
+void bench_help(){
+    printf("kvd_bench --unix <path>     -- connect to unix domain socket path\r\n"
+           "kvd_bench --port <port>     -- connect to 127.0.0.1:port, 7380 by default\r\n"
+           "kvd_bench --threads <n>     -- connections, each on its own thread, 4 by default\r\n"
+           "kvd_bench --depth <n>       -- requests in flight per connection, 64 by default\r\n"
+           "kvd_bench --requests <n>    -- requests per connection, 1000000 by default\r\n"
+           "kvd_bench --reads <percent> -- share of gets, the rest are puts, 50 by default\r\n"
+           "kvd_bench --keys <n>        -- keys are drawn from [0, n), 1000000 by default\r\n"
+           "kvd_bench --batch           -- send each round as one explicit batch\r\n");
+}
+
+uint64_t bench_now_usec(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint32_t bench_rand(uint32_t* seed){
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+int bench_connect(){
+    int fd;
+    if(bench_path != NULL){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, bench_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+            return -1;
+        }
+        return fd;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons((uint16_t)bench_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool bench_io(int fd, void* buf, size_t size, bool out){
+    uint8_t* p = (uint8_t*)buf;
+    for(; size > 0;){
+        ssize_t n = out ? write(fd, p, size) : read(fd, p, size);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return false;
+        }
+        p    += n;
+        size -= n;
+    }
+    return true;
+}
+
+// each round sends depth requests at once and then waits for all responses
+void* bench_run(void* arg){
+    bench_worker* w  = (bench_worker*)arg;
+    int           fd = bench_connect();
+    if(fd < 0){
+        printf("connect failed with errno: %d\r\n", errno);
+        return NULL;
+    }
+
+    kvd_request*  reqs  = (kvd_request*)calloc(bench_depth + 1, sizeof(kvd_request));
+    kvd_response* resps = (kvd_response*)calloc(bench_depth, sizeof(kvd_response));
+    for(uint64_t sent = 0; sent < bench_requests;){
+        uint32_t num = bench_requests - sent < bench_depth ? (uint32_t)(bench_requests - sent) : bench_depth;
+        uint32_t pos = 0;
+        if(bench_batch){
+            reqs[pos].op  = KVD_OP_BATCH;
+            reqs[pos].key = num;
+            ++pos;
+        }
+        for(uint32_t i=0; i<num; ++i, ++pos){
+            kvd_request* r = reqs + pos;
+            r->op    = bench_rand(&w->seed) % 100 < bench_reads ? KVD_OP_GET : KVD_OP_PUT;
+            r->id    = (uint32_t)(sent + i);
+            r->key   = bench_rand(&w->seed) % bench_keys;
+            r->value = r->key;
+        }
+
+        uint64_t begin = bench_now_usec();
+        if(!bench_io(fd, reqs, sizeof(kvd_request) * pos, true) ||
+           !bench_io(fd, resps, sizeof(kvd_response) * num, false)){
+            printf("connection lost after %lu requests\r\n", w->done);
+            break;
+        }
+        uint64_t cost = bench_now_usec() - begin;
+        if(cost > w->round_usec_max){
+            w->round_usec_max = cost;
+        }
+
+        for(uint32_t i=0; i<num; ++i){
+            if(resps[i].id != (uint32_t)(sent + i) || resps[i].status == KVD_STATUS_INVALID){
+                w->errors += 1;
+            }
+        }
+        sent    += num;
+        w->done += num;
+    }
+
+    free(reqs);
+    free(resps);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char** argv){
+    static struct option long_options[] = {
+            {"help",     no_argument,       NULL, 'h'},
+            {"unix",     required_argument, NULL, 'u'},
+            {"port",     required_argument, NULL, 'p'},
+            {"threads",  required_argument, NULL, 'j'},
+            {"depth",    required_argument, NULL, 'd'},
+            {"requests", required_argument, NULL, 'n'},
+            {"reads",    required_argument, NULL, 'r'},
+            {"keys",     required_argument, NULL, 'k'},
+            {"batch",    no_argument,       NULL, 'b'},
+            {0,          0,                 0,     0 }
+    };
+
+    int opt;
+    int option_index = 0;
+    while((opt=getopt_long(argc, argv, "", long_options, &option_index)) != -1){
+        switch(opt){
+            case 'u':
+                bench_path = optarg;
+                break;
+            case 'p':
+                bench_port = atoi(optarg);
+                break;
+            case 'j':
+                bench_threads = atoi(optarg);
+                break;
+            case 'd':
+                bench_depth = atoi(optarg);
+                break;
+            case 'n':
+                bench_requests = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench_reads = atoi(optarg);
+                break;
+            case 'k':
+                bench_keys = strtoll(optarg, NULL, 10);
+                break;
+            case 'b':
+                bench_batch = true;
+                break;
+            default:
+                bench_help();
+                return 0;
+        }
+    }
+    bench_threads = bench_threads < 1 ? 1 : (bench_threads > BENCH_MAX_THREADS ? BENCH_MAX_THREADS : bench_threads);
+    bench_depth   = bench_depth < 1 ? 1 : (bench_depth > KVD_BATCH_MAX ? KVD_BATCH_MAX : bench_depth);
+    bench_keys    = bench_keys < 1 ? 1 : bench_keys;
+
+    bench_worker workers[BENCH_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    uint64_t begin = bench_now_usec();
+    for(uint32_t i=0; i<bench_threads; ++i){
+        workers[i].seed = 2463534242u + i * 7919;
+        if(pthread_create(&workers[i].tid, NULL, bench_run, workers + i) != 0){
+            printf("create bench thread failed with errno: %d\r\n", errno);
+            return 1;
+        }
+    }
+
+    uint64_t done = 0, errors = 0, round_max = 0;
+    for(uint32_t i=0; i<bench_threads; ++i){
+        pthread_join(workers[i].tid, NULL);
+        done   += workers[i].done;
+        errors += workers[i].errors;
+        round_max = workers[i].round_usec_max > round_max ? workers[i].round_usec_max : round_max;
+    }
+    uint64_t total = bench_now_usec() - begin;
+
+    printf("bench connections: %u depth: %u reads: %u%% batch: %s\r\n",
+           bench_threads, bench_depth, bench_reads, bench_batch ? "yes" : "no");
+    printf("bench requests: %lu errors: %lu time: %lu usec\r\n", done, errors, total);
+    printf("bench throughput: %.0f req/s round max: %lu usec\r\n",
+           total > 0 ? done * 1000000.0 / total : 0.0, round_max);
+    return errors > 0;
+}
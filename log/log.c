@@ -1,3 +1,166 @@
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include "log.h"
 
-int log_level_ = LEVEL_DEBUG;
\ No newline at end of file
+#define LOG_RING_SIZE 4096
+#define LOG_MSG_SIZE  256
+
+// bounded multi-producer single-consumer ring, a slot is free for the
+// producer claiming position pos when seq == pos and readable by the
+// writer when seq == pos + 1
+typedef struct __log_slot{
+    uint64_t seq;
+    uint8_t  fd;
+    uint16_t len;
+    char     msg[LOG_MSG_SIZE];
+}log_slot;
+
+static log_slot       log_ring[LOG_RING_SIZE];
+static uint64_t       log_tail = 0;
+static uint64_t       log_head = 0;
+static uint64_t       log_drop = 0;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static __thread time_t log_ts_sec = -1;
+static __thread char   log_ts_buf[16];
+
+static const char* log_timestamp();
+
+static void log_sleep(long nsec){
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = nsec};
+    nanosleep(&ts, NULL);
+}
+
+static bool log_drain(){
+    bool busy = false;
+    for(;;){
+        log_slot* s = log_ring + (log_head % LOG_RING_SIZE);
+        if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != log_head + 1){
+            break;
+        }
+        fwrite(s->msg, s->len, 1, s->fd == LOG_STDERR ? stderr : stdout);
+        __atomic_store_n(&s->seq, log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_head, log_head + 1, __ATOMIC_RELEASE);
+        busy = true;
+    }
+    static uint64_t reported = 0;
+    uint64_t dropped = log_dropped();
+    if(dropped != reported){
+        fprintf(stderr, "[%s] [W] [%s:%d] %lu log records dropped\n", log_timestamp(), __func__, __LINE__, dropped - reported);
+        reported = dropped;
+        busy = true;
+    }
+    if(busy){
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return busy;
+}
+
+static void* log_writer(void* arg){
+    long idle = 1000;
+    for(;;){
+        if(log_drain()){
+            idle = 1000;
+            continue;
+        }
+        log_sleep(idle);
+        if(idle < 1000000){
+            idle *= 2;
+        }
+    }
+    return NULL;
+}
+
+static void log_start(){
+    for(uint64_t i=0; i<LOG_RING_SIZE; ++i){
+        log_ring[i].seq = i;
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, log_writer, NULL);
+    pthread_detach(tid);
+    atexit(log_flush);
+}
+
+static const char* log_timestamp(){
+    time_t t = time(NULL);
+    if(t != log_ts_sec){
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(log_ts_buf, sizeof(log_ts_buf), "%H:%M:%S", &tm);
+        log_ts_sec = t;
+    }
+    return log_ts_buf;
+}
+
+static int log_format(char* buf, size_t size, const char* tag, const char* func, int line,
+                      const char* fmt, va_list args){
+    int n = snprintf(buf, size, "[%s] [%s] [%s:%d] ", log_timestamp(), tag, func, line);
+    if(n < 0 || n >= size - 1){
+        n = size - 2;
+    }else{
+        int m = vsnprintf(buf + n, size - n, fmt, args);
+        n = (m < 0 || n + m >= size - 1) ? size - 2 : n + m;
+    }
+    buf[n++] = '\n';
+    buf[n]   = 0;
+    return n;
+}
+
+void log_write(int level, const char* tag, int fd, const char* func, int line, const char* fmt, ...){
+    pthread_once(&log_once, log_start);
+
+    uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    log_slot* s;
+    for(;;){
+        s = log_ring + (pos % LOG_RING_SIZE);
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if(seq == pos){
+            if(__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }else if(seq < pos){
+            // ring is full, never block the caller
+            __atomic_fetch_add(&log_drop, 1, __ATOMIC_RELAXED);
+            return;
+        }else{
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    s->len = log_format(s->msg, sizeof(s->msg), tag, func, line, fmt, args);
+    va_end(args);
+    s->fd  = fd;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush(){
+    uint64_t tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+    for(; __atomic_load_n(&log_head, __ATOMIC_ACQUIRE) < tail;){
+        log_sleep(100000);
+    }
+}
+
+uint64_t log_dropped(){
+    return __atomic_load_n(&log_drop, __ATOMIC_RELAXED);
+}
+
+void log_fatal(const char* func, int line, const char* fmt, ...){
+    char buf[LOG_MSG_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int n = log_format(buf, sizeof(buf), "F", func, line, fmt, args);
+    va_end(args);
+
+    log_flush();
+    fflush(stdout);
+    fwrite(buf, n, 1, stderr);
+    fflush(stderr);
+    exit(-1);
+}
@@ -2,7 +2,7 @@
 #define _KV_LOG_H_
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdint.h>
 
 #define LEVEL_DEBUG 5
 #define LEVEL_INFO  4
@@ -10,23 +10,51 @@
 #define LEVEL_ERROR 2
 #define LEVEL_FATAL 1
 
+// levels above KV_LOG_LEVEL are compiled out
+#ifndef KV_LOG_LEVEL
+#define KV_LOG_LEVEL LEVEL_INFO
+#endif
+
+#define LOG_STDOUT 1
+#define LOG_STDERR 2
+
+void log_write(int level, const char* tag, int fd, const char* func, int line, const char* fmt, ...)
+    __attribute__((format(printf, 6, 7)));
+void log_fatal(const char* func, int line, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4), noreturn));
+void log_flush();
+uint64_t log_dropped();
+
+// the level is only checked at compile time, an enabled call always writes
 #define PRINT(__LEVEL__, __LEVEL_TAG__, __FD__, __FMT__, ...) \
-    if (__LEVEL__ <= log_level_) {                            \
-        time_t t = time(NULL); \
-        char tmp[16]; \
-        strftime(tmp, sizeof(tmp), "%H:%M:%S", localtime(&t)); \
-        fprintf(__FD__, "[%s] [%s] [%s:%d] ", tmp, __LEVEL_TAG__, __func__, __LINE__); \
-        fprintf(__FD__, __FMT__, ##__VA_ARGS__); \
-        fprintf(__FD__, "\n");\
-    }
-
-#define DEBUG(fmt, ...) PRINT(LEVEL_DEBUG, "D", stdout, fmt, ##__VA_ARGS__)
-#define INFO(fmt, ...)  PRINT(LEVEL_INFO, "I", stdout, fmt, ##__VA_ARGS__)
-#define WARN(fmt, ...)  PRINT(LEVEL_WARN, "W", stdout, fmt, ##__VA_ARGS__)
-#define ERROR(fmt, ...) PRINT(LEVEL_ERROR, "E", stderr, fmt, ##__VA_ARGS__)
-#define FATAL(fmt, ...) fflush(stderr); fflush(stdout); PRINT(LEVEL_FATAL,"F", stderr, fmt, ##__VA_ARGS__); fflush(stderr); exit(-1);
-
-extern int log_level_;
-#define SET_LOG_LEVEL(__level__) log_level_ = (__level__);
-
-#endif//_KV_LOG_H_
\ No newline at end of file
+    do { \
+        log_write(__LEVEL__, __LEVEL_TAG__, __FD__, __func__, __LINE__, __FMT__, ##__VA_ARGS__); \
+    } while (0)
+
+#if KV_LOG_LEVEL >= LEVEL_DEBUG
+#define DEBUG(fmt, ...) PRINT(LEVEL_DEBUG, "D", LOG_STDOUT, fmt, ##__VA_ARGS__)
+#else
+#define DEBUG(fmt, ...) do {} while (0)
+#endif
+
+#if KV_LOG_LEVEL >= LEVEL_INFO
+#define INFO(fmt, ...)  PRINT(LEVEL_INFO, "I", LOG_STDOUT, fmt, ##__VA_ARGS__)
+#else
+#define INFO(fmt, ...)  do {} while (0)
+#endif
+
+#if KV_LOG_LEVEL >= LEVEL_WARN
+#define WARN(fmt, ...)  PRINT(LEVEL_WARN, "W", LOG_STDOUT, fmt, ##__VA_ARGS__)
+#else
+#define WARN(fmt, ...)  do {} while (0)
+#endif
+
+#if KV_LOG_LEVEL >= LEVEL_ERROR
+#define ERROR(fmt, ...) PRINT(LEVEL_ERROR, "E", LOG_STDERR, fmt, ##__VA_ARGS__)
+#else
+#define ERROR(fmt, ...) do {} while (0)
+#endif
+
+#define FATAL(fmt, ...) log_fatal(__func__, __LINE__, fmt, ##__VA_ARGS__)
+
+#endif//_KV_LOG_H_
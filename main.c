@@ -4,20 +4,75 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "log.h"
 #include "kv.h"
+#include "trace.h"
 
 #define KV_NAME "test.kdb"
+#define KV_MAX_THREADS 256
 #define MIN(a, b) (a) <= (b) ? (a): (b)
+// commands applied per kv_tree_apply_batch call
+#define KV_BATCH_OPS   4096
+// a binary batch stream starts with this magic followed by KV_BATCH_FRAME byte frames
+#define KV_BATCH_MAGIC 0x6874626b
+#define KV_BATCH_FRAME 17
 
 void cmd_help();
-void cmd_get(kv_file *kv, const char* k);
-void cmd_put(kv_file *kv, const char* key_value);
-void cmd_del(kv_file *kv, const char* k);
+void cmd_get(kv_tree *t, const char* k);
+void cmd_put(kv_tree *t, const char* key_value);
+void cmd_del(kv_tree *t, const char* k);
+void cmd_incr(kv_tree *t, const char* key_delta);
 void cmd_list(kv_file *kv);
 void cmd_insert_batch(kv_file *kv, const char* n);
+void cmd_bench_get(kv_tree *t, const char* n);
 void cmd_clear(kv_file *kv);
 void cmd_verify(kv_file *kv);
+void cmd_stats(kv_file *kv);
+void cmd_threads(const char* n);
+void cmd_check(kv_file *kv);
+void cmd_maintain(kv_file *kv);
+void cmd_aggregate(kv_tree *t, const char* min_max);
+void cmd_del_range(kv_tree *t, const char* min_max);
+void cmd_trace_sample(const char* n);
+void cmd_trace(const char* file, int format);
+void cmd_cache(const char* n);
+void cmd_page_size(const char* n);
+void cmd_widths(const char* key_value);
+void cmd_backup(kv_file *kv, const char* file);
+void cmd_dump(kv_tree *t, const char* file);
+void cmd_load(kv_tree *t, const char* file);
+void cmd_batch(kv_tree *t, const char* file);
+
+kv_options  db_options;
+const char* db_name = KV_NAME;
+bool        db_memory = false;
+kv_file*   db = NULL;
+kv_tree*   db_tree = NULL;
+
+// options changing how the database is opened must come before the first command
+kv_file* get_db(){
+    if(db == NULL){
+        db = kv_open_ex(db_memory ? NULL : db_name, &db_options);
+    }
+    return db;
+}
+
+// get, put, del, delr and agg work on the tree chosen by --tree, the main tree by default
+kv_tree* get_tree(){
+    if(db_tree == NULL){
+        db_tree = kv_tree_open(get_db(), NULL);
+    }
+    return db_tree;
+}
+
+void cmd_tree(const char* name){
+    db_tree = kv_tree_open(get_db(), name);
+    if(db_tree == NULL){
+        FATAL("open tree %s failed, names are shorter than %d bytes", name, KV_TREE_NAME_SIZE);
+    }
+}
 
 int main(int argc, char** argv) {
     static struct option long_options[] = {
@@ -25,10 +80,33 @@ int main(int argc, char** argv) {
             {"get",  required_argument, NULL, 'g'},
             {"put",  required_argument, NULL, 'p'},
             {"del",  required_argument, NULL, 'd'},
+            {"incr", required_argument, NULL, 'I'},
             {"list", optional_argument, NULL, 'l'},
             {"ins",  required_argument, NULL, 'i'},
+            {"bench-get", required_argument, NULL, 'G'},
             {"clr",  no_argument,       NULL, 'c'},
             {"ver",  no_argument,       NULL, 'v'},
+            {"stats",no_argument,       NULL, 's'},
+            {"agg",  required_argument, NULL, 'a'},
+            {"delr", required_argument, NULL, 'r'},
+            {"threads", required_argument, NULL, 'j'},
+            {"check", no_argument,      NULL, 'k'},
+            {"maintain", no_argument,   NULL, 'M'},
+            {"trace-sample", required_argument, NULL, 'S'},
+            {"trace",        required_argument, NULL, 't'},
+            {"trace-folded", required_argument, NULL, 'T'},
+            {"cache", required_argument, NULL, 'C'},
+            {"page-size", required_argument, NULL, 'P'},
+            {"widths", required_argument, NULL, 'W'},
+            {"warm",  no_argument,       NULL, 'w'},
+            {"lazy",  no_argument,       NULL, 'z'},
+            {"tree",  required_argument, NULL, 'n'},
+            {"backup", required_argument, NULL, 'b'},
+            {"dump",   required_argument, NULL, 'D'},
+            {"load",   required_argument, NULL, 'L'},
+            {"mem",    no_argument,       NULL, 'm'},
+            {"file",   required_argument, NULL, 'f'},
+            {"batch",  required_argument, NULL, 'B'},
             {0,      0,                 0,     0 }
     };
 
@@ -37,8 +115,7 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    SET_LOG_LEVEL(LEVEL_DEBUG)
-    kv_file *kv = kv_open(KV_NAME);
+    kv_options_init(&db_options);
 
     int opt;
     int option_index = 0;
@@ -49,32 +126,103 @@ int main(int argc, char** argv) {
                 cmd_help();
                 break;
             case 'g':
-                cmd_get(kv, optarg);
+                cmd_get(get_tree(), optarg);
                 break;
             case 'p':
-                cmd_put(kv, optarg);
+                cmd_put(get_tree(), optarg);
                 break;
             case 'd':
-                cmd_del(kv, optarg);
+                cmd_del(get_tree(), optarg);
+                break;
+            case 'I':
+                cmd_incr(get_tree(), optarg);
                 break;
             case 'l':
-                cmd_list(kv);
+                cmd_list(get_db());
                 break;
             case 'i':
-                cmd_insert_batch(kv, optarg);
+                cmd_insert_batch(get_db(), optarg);
+                break;
+            case 'G':
+                cmd_bench_get(get_tree(), optarg);
                 break;
             case 'c':
-                cmd_clear(kv);
+                cmd_clear(get_db());
                 break;
             case 'v':
-                cmd_verify(kv);
+                cmd_verify(get_db());
+                break;
+            case 's':
+                cmd_stats(get_db());
+                break;
+            case 'a':
+                cmd_aggregate(get_tree(), optarg);
+                break;
+            case 'r':
+                cmd_del_range(get_tree(), optarg);
+                break;
+            case 'j':
+                cmd_threads(optarg);
+                break;
+            case 'k':
+                cmd_check(get_db());
+                break;
+            case 'S':
+                cmd_trace_sample(optarg);
+                break;
+            case 't':
+                cmd_trace(optarg, TRACE_DUMP_EVENTS);
+                break;
+            case 'T':
+                cmd_trace(optarg, TRACE_DUMP_FOLDED);
+                break;
+            case 'C':
+                cmd_cache(optarg);
+                break;
+            case 'P':
+                cmd_page_size(optarg);
+                break;
+            case 'W':
+                cmd_widths(optarg);
+                break;
+            case 'w':
+                db_options.warm_cache = true;
+                break;
+            case 'z':
+                db_options.lazy_delete = true;
+                break;
+            case 'm':
+                db_memory = true;
+                break;
+            case 'f':
+                db_name = optarg;
+                break;
+            case 'n':
+                cmd_tree(optarg);
+                break;
+            case 'b':
+                cmd_backup(get_db(), optarg);
+                break;
+            case 'M':
+                cmd_maintain(get_db());
+                break;
+            case 'D':
+                cmd_dump(get_tree(), optarg);
+                break;
+            case 'L':
+                cmd_load(get_tree(), optarg);
+                break;
+            case 'B':
+                cmd_batch(get_tree(), optarg);
                 break;
             default:
                 break;
         }
     }
 
-    kv_close(kv);
+    if(db != NULL){
+        kv_close(db);
+    }
     return 0;
 }
 
@@ -83,20 +231,43 @@ void cmd_help() {
            "kv --get <key>           -- get key\r\n"
            "kv --put <key:value>     -- put key value\r\n"
            "kv --del <key>           -- delete key\r\n"
+           "kv --incr <key:delta>    -- add delta to the value of key, missing key counts as 0\r\n"
+           "kv --delr <min:max>      -- delete keys in [min, max)\r\n"
            "kv --list                -- list all keys\r\n"
            "kv --ins <num>           -- insert key in batch\r\n"
+           "kv --bench-get <num>     -- time num random gets of existing keys once all pages are cached\r\n"
            "kv --clr                 -- clear all record\r\n"
-           "kv --ver                 -- verify all records\r\n");
+           "kv --ver                 -- verify all records\r\n"
+           "kv --check               -- check b+ tree structure\r\n"
+           "kv --maintain            -- rebalance leaves deferred by --lazy, then check no page is left underfull\r\n"
+           "kv --threads <n>         -- worker threads for list, ver and check\r\n"
+           "kv --cache <pages>       -- cache size in pages, before other commands\r\n"
+           "kv --page-size <bytes>   -- page size of a new database, 4096 to 65536, before other commands\r\n"
+           "kv --widths <key:value>  -- key and value bits of a new database, 32 or 64, before other commands\r\n"
+           "kv --warm                -- prefetch pages cached at last close, before other commands\r\n"
+           "kv --lazy                -- defer rebalancing after deletes, before other commands\r\n"
+           "kv --mem                 -- use a temporary database in memory, before other commands\r\n"
+           "kv --file <db>           -- database file, test.kdb by default, before other commands\r\n"
+           "kv --tree <name>         -- use named tree for get, put, del, delr and agg\r\n"
+           "kv --backup <file>       -- copy a consistent image of the database to file\r\n"
+           "kv --dump <file>         -- dump records of the tree to file\r\n"
+           "kv --load <file>         -- load records dumped to file into the tree\r\n"
+           "kv --batch <file>        -- apply get/put/del commands read from file, - for stdin\r\n"
+           "kv --stats               -- show engine statistics\r\n"
+           "kv --agg <min:max>       -- count/sum/min/max values in [min, max)\r\n"
+           "kv --trace-sample <n>    -- trace 1 in n operations\r\n"
+           "kv --trace <file>        -- dump trace events to file\r\n"
+           "kv --trace-folded <file> -- dump trace folded stacks to file\r\n");
 }
 
 int64_t str2int64(const char* str){
     return strtoll(str, NULL, 10);
 }
 
-void cmd_get(kv_file *kv, const char* k) {
+void cmd_get(kv_tree *t, const char* k) {
     int64_t val = 0;
     int64_t key = str2int64(k);
-    int ret = kv_get(kv, key, &val);
+    int ret = kv_tree_get(t, key, &val);
     if( ret ){
         printf("get key=%ld error=%d\r\n", key, ret);
     }else{
@@ -105,7 +276,7 @@ void cmd_get(kv_file *kv, const char* k) {
 }
 
 
-void cmd_put(kv_file *kv, const char* key_value) {
+void cmd_put(kv_tree *t, const char* key_value) {
     char buf[32] = {0};
     strcpy(buf, key_value);
     char *sep = strstr(buf, ":");
@@ -117,7 +288,7 @@ void cmd_put(kv_file *kv, const char* key_value) {
     *sep = 0;
     int64_t key = str2int64(buf);
     int64_t val = str2int64(++sep);
-    int ret = kv_put(kv, key, val);
+    int ret = kv_tree_put(t, key, val);
     if(ret){
         printf("put key=%ld val=%ld error=%d\r\n", key, val, ret);
     }else{
@@ -125,9 +296,9 @@ void cmd_put(kv_file *kv, const char* key_value) {
     }
 }
 
-void cmd_del(kv_file *kv, const char* k){
+void cmd_del(kv_tree *t, const char* k){
     int64_t key = str2int64(k);
-    int ret = kv_del(kv, key);
+    int ret = kv_tree_del(t, key);
     if(ret){
         printf("del key=%ld error=%d\r\n", key, ret);
     }else{
@@ -135,9 +306,95 @@ void cmd_del(kv_file *kv, const char* k){
     }
 }
 
+void cmd_incr(kv_tree *t, const char* key_delta){
+    char buf[64] = {0};
+    strncpy(buf, key_delta, sizeof(buf) - 1);
+    char *sep = strstr(buf, ":");
+    if(sep == NULL){
+        printf("kv incr invalid key delta\r\n");
+        return;
+    }
+
+    *sep = 0;
+    int64_t key   = str2int64(buf);
+    int64_t delta = str2int64(++sep);
+    int64_t val   = 0;
+    int ret = kv_tree_incr(t, key, delta, &val);
+    if(ret){
+        printf("incr key=%ld delta=%ld error=%d\r\n", key, delta, ret);
+    }else{
+        printf("incr key=%ld val=%ld\r\n", key, val);
+    }
+}
+
+uint16_t scan_threads = 0;
+
+void cmd_cache(const char* n){
+    int64_t num = str2int64(n);
+    db_options.cache_pages = num < 16 ? 16 : num;
+}
+
+void cmd_page_size(const char* n){
+    int64_t size = str2int64(n);
+    db_options.page_size = size < 0 || size > UINT32_MAX ? 0 : (uint32_t)size;
+}
+
+void cmd_widths(const char* key_value){
+    char buf[32] = {0};
+    strncpy(buf, key_value, sizeof(buf) - 1);
+    char *sep = strstr(buf, ":");
+    if(sep == NULL){
+        printf("kv widths invalid key:value pair\r\n");
+        return;
+    }
+
+    *sep = 0;
+    int64_t key = str2int64(buf);
+    int64_t val = str2int64(++sep);
+    // kv_open_ex rejects anything but 32 and 64
+    db_options.key_bits   = key < 0 || key > UINT8_MAX ? 0 : (uint8_t)key;
+    db_options.value_bits = val < 0 || val > UINT8_MAX ? 0 : (uint8_t)val;
+}
+
+void cmd_threads(const char* n){
+    int64_t num = str2int64(n);
+    scan_threads = num < 1 ? 1 : (num > KV_MAX_THREADS ? KV_MAX_THREADS : num);
+}
+
+uint16_t get_scan_threads(){
+    if(scan_threads > 0){
+        return scan_threads;
+    }
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return num < 1 ? 1 : (num > KV_MAX_THREADS ? KV_MAX_THREADS : num);
+}
+
 void iterate(void* ptr, uint16_t page, int64_t key, int64_t value);
 void cmd_list(kv_file *kv){
-    kv_iterate(kv, NULL, iterate);
+    // each worker lists its own key range into a temp file, which are then
+    // copied out in key order
+    uint16_t nthreads = get_scan_threads();
+    FILE* files[KV_MAX_THREADS];
+    for(uint16_t i=0; i<nthreads; ++i){
+        files[i] = tmpfile();
+        if(files[i] == NULL){
+            printf("list create temp file error\r\n");
+            return;
+        }
+    }
+
+    int parts = kv_parallel_iterate(kv, nthreads, (void**)files, iterate);
+    char buf[64 * 1024];
+    for(uint16_t i=0; i<nthreads; ++i){
+        if(i < parts){
+            rewind(files[i]);
+            size_t n;
+            while((n = fread(buf, 1, sizeof(buf), files[i])) > 0){
+                fwrite(buf, 1, n, stdout);
+            }
+        }
+        fclose(files[i]);
+    }
 }
 
 int64_t get_timestamp_usec() {
@@ -175,6 +432,58 @@ void cmd_insert_batch(kv_file *kv, const char *n){
     printf("batch time per record: %ld usec\r\n", tpr);
 }
 
+struct ctx_keys {
+    int64_t* keys;
+    int64_t  num;
+    int64_t  cap;
+};
+
+void collect_key(void* ptr, uint16_t page, int64_t key, int64_t val){
+    struct ctx_keys* ctx = (struct ctx_keys*)ptr;
+    if(ctx->num >= ctx->cap){
+        ctx->cap  = ctx->cap > 0 ? ctx->cap * 2 : 4096;
+        ctx->keys = (int64_t*)realloc(ctx->keys, sizeof(int64_t) * ctx->cap);
+    }
+    ctx->keys[ctx->num++] = key;
+}
+
+// a first pass gets every key so that the timed gets are served from the cache
+// when it is large enough, cache misses are printed to tell
+void cmd_bench_get(kv_tree *t, const char* n){
+    int64_t num = str2int64(n);
+    struct ctx_keys ctx = {.keys = NULL, .num = 0, .cap = 0};
+    kv_tree_iterate(t, &ctx, collect_key);
+    if(ctx.num == 0 || num <= 0){
+        printf("bench get needs keys in the tree and num > 0\r\n");
+        free(ctx.keys);
+        return;
+    }
+
+    int64_t value;
+    for(int64_t i=0; i<ctx.num; ++i){
+        kv_tree_get(t, ctx.keys[i], &value);
+    }
+
+    kv_stats before, after;
+    kv_get_stats(get_db(), &before);
+    uint32_t seed  = 2463534242u;
+    int64_t  found = 0;
+    int64_t  now   = get_timestamp_usec();
+    for(int64_t i=0; i<num; ++i){
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        found += kv_tree_get(t, ctx.keys[seed % ctx.num], &value) == CODE_SUCCEED;
+    }
+    int64_t total = get_timestamp_usec() - now;
+    kv_get_stats(get_db(), &after);
+
+    printf("bench get: %ld found: %ld keys: %ld total time: %ld usec\r\n", num, found, ctx.num, total);
+    printf("bench get time per lookup: %.1f nsec cache misses: %lu\r\n",
+           total * 1000.0 / num, after.cache_misses - before.cache_misses);
+    free(ctx.keys);
+}
+
 void cmd_clear(kv_file* kv){
     int ret = kv_clear(kv);
     if(ret){
@@ -192,13 +501,26 @@ struct ctx_verify {
 void verify(void* ptr, uint16_t page, int64_t key, int64_t val);
 
 void cmd_verify(kv_file *kv) {
+    uint16_t nthreads = get_scan_threads();
+    struct ctx_verify ctxs[KV_MAX_THREADS];
+    void* ptrs[KV_MAX_THREADS];
+    for(uint16_t i=0; i<nthreads; ++i){
+        ctxs[i].total = 0;
+        ctxs[i].valid = 0;
+        ptrs[i] = ctxs + i;
+    }
+
+    int parts = kv_parallel_iterate(kv, nthreads, ptrs, verify);
     struct ctx_verify ctx={.total = 0, .valid=0};
-    kv_iterate(kv, &ctx, verify);
+    for(int i=0; i<parts; ++i){
+        ctx.total += ctxs[i].total;
+        ctx.valid += ctxs[i].valid;
+    }
     printf("verify total: %ld valid: %ld invalid: %ld\r\n", ctx.total, ctx.valid, ctx.total-ctx.valid);
 }
 
 void iterate(void* ptr, uint16_t page, int64_t key, int64_t val){
-    printf("list key=%ld val=%ld\r\n", key, val);
+    fprintf((FILE*)ptr, "list key=%ld val=%ld\r\n", key, val);
 }
 
 void verify(void* ptr, uint16_t page, int64_t key, int64_t val){
@@ -208,4 +530,395 @@ void verify(void* ptr, uint16_t page, int64_t key, int64_t val){
         ++ctx->valid;
     }
     ++ctx->total;
-}
\ No newline at end of file
+}
+
+void print_fill(const char* name, uint32_t* fill){
+    printf("%s fill:", name);
+    for(int i=0; i<KV_STATS_FILL_BUCKETS; ++i){
+        printf(" %d%%:%u", i * 100 / KV_STATS_FILL_BUCKETS, fill[i]);
+    }
+    printf("\r\n");
+}
+
+void cmd_stats(kv_file *kv){
+    kv_stats stats;
+    int ret = kv_get_stats(kv, &stats);
+    if(ret){
+        printf("stats error=%d\r\n", ret);
+        return;
+    }
+
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    printf("cache pages: %u node pool pages: %u dirty: %u\r\n", stats.cache_pages, stats.node_pool_pages, stats.dirty_pages);
+    printf("cache hits: %lu misses: %lu hit rate: %.2f%% evictions: %lu dirty evictions: %lu\r\n",
+           stats.cache_hits, stats.cache_misses,
+           lookups ? stats.cache_hits * 100.0 / lookups : 0.0, stats.cache_evictions, stats.dirty_evictions);
+    printf("pages read: %lu written: %lu\r\n", stats.pages_read, stats.pages_written);
+    printf("dirty flushes: %lu total: %lu usec max: %lu usec\r\n",
+           stats.dirty_flushes, stats.flush_usec, stats.flush_usec_max);
+    printf("file extends: %lu pages: %u page size: %u\r\n", stats.file_extends, stats.page_num, stats.page_size);
+    printf("key bits: %u value bits: %u\r\n", stats.key_bits, stats.value_bits);
+    printf("splits: %lu merges: %lu borrows: %lu hinted puts: %lu\r\n",
+           stats.splits, stats.merges, stats.borrows, stats.hinted_puts);
+    printf("tree height: %u node pages: %u leaf pages: %u records: %lu\r\n",
+           stats.tree_height, stats.node_pages, stats.leaf_pages, stats.records);
+    print_fill("node", stats.node_fill);
+    print_fill("leaf", stats.leaf_fill);
+}
+
+void cmd_trace_sample(const char* n){
+#ifdef KV_TRACE
+    trace_set_sample((uint32_t)str2int64(n));
+#else
+    printf("trace not enabled, rebuild with -DKV_TRACE=ON\r\n");
+#endif
+}
+
+void cmd_trace(const char* file, int format){
+#ifdef KV_TRACE
+    FILE* f = fopen(file, "w");
+    if(f == NULL){
+        printf("open trace file %s failed\r\n", file);
+        return;
+    }
+    trace_dump(f, format);
+    fclose(f);
+#else
+    printf("trace not enabled, rebuild with -DKV_TRACE=ON\r\n");
+#endif
+}
+
+void cmd_aggregate(kv_tree *t, const char* min_max){
+    char buf[64] = {0};
+    strncpy(buf, min_max, sizeof(buf) - 1);
+    char *sep = strstr(buf, ":");
+    if(sep == NULL){
+        printf("kv agg invalid range\r\n");
+        return;
+    }
+
+    *sep = 0;
+    int64_t min = str2int64(buf);
+    int64_t max = str2int64(++sep);
+    kv_aggregate agg;
+    int64_t now = get_timestamp_usec();
+    int ret = kv_tree_range_aggregate(t, min, max, KV_AGG_ALL, &agg);
+    int64_t total = get_timestamp_usec() - now;
+    if(ret){
+        printf("agg min=%ld max=%ld error=%d\r\n", min, max, ret);
+        return;
+    }
+    printf("agg count=%lu sum=%ld min=%ld max=%ld\r\n", agg.count, agg.sum, agg.min, agg.max);
+    printf("agg total time: %ld usec\r\n", total);
+}
+
+void cmd_del_range(kv_tree *t, const char* min_max){
+    char buf[64] = {0};
+    strncpy(buf, min_max, sizeof(buf) - 1);
+    char *sep = strstr(buf, ":");
+    if(sep == NULL){
+        printf("kv delr invalid range\r\n");
+        return;
+    }
+
+    *sep = 0;
+    int64_t min = str2int64(buf);
+    int64_t max = str2int64(++sep);
+    int64_t now = get_timestamp_usec();
+    int ret = kv_tree_del_range(t, min, max);
+    int64_t total = get_timestamp_usec() - now;
+    if(ret){
+        printf("delr min=%ld max=%ld error=%d\r\n", min, max, ret);
+        return;
+    }
+    printf("delr min=%ld max=%ld succeed\r\n", min, max);
+    printf("delr total time: %ld usec\r\n", total);
+}
+
+void cmd_check(kv_file *kv){
+    kv_check_result r;
+    int64_t now = get_timestamp_usec();
+    int ret = kv_check(kv, get_scan_threads(), &r);
+    int64_t total = get_timestamp_usec() - now;
+    log_flush();
+
+    printf("check pages: %u tree: %u free: %u height: %u records: %lu underfull: %u\r\n",
+           r.page_num, r.tree_pages, r.free_pages, r.height, r.records, r.underfull_pages);
+    printf("check bad id: %u type: %u order: %u bound: %u parent: %u next: %u unbalanced: %u\r\n",
+           r.bad_page_id, r.bad_type, r.bad_order, r.bad_bound, r.bad_parent, r.bad_next, r.unbalanced);
+    printf("check duplicate: %u leaked: %u bad free: %u\r\n", r.duplicate_pages, r.leaked_pages, r.bad_free);
+    printf("check %s errors: %lu time: %ld usec\r\n", ret ? "failed" : "succeed", r.errors, total);
+}
+
+// after maintenance every page but the root must be back to the minimum fill
+void cmd_maintain(kv_file *kv){
+    int64_t  now = get_timestamp_usec();
+    uint32_t num = kv_maintain(kv);
+    int64_t  total = get_timestamp_usec() - now;
+
+    kv_check_result r;
+    int ret = kv_check(kv, get_scan_threads(), &r);
+    log_flush();
+    if(ret == CODE_SUCCEED && r.underfull_pages > 0){
+        ret = CODE_CORRUPTED;
+    }
+    printf("maintain rebalanced: %u time: %ld usec\r\n", num, total);
+    printf("maintain %s underfull: %u errors: %lu\r\n", ret ? "failed" : "succeed", r.underfull_pages, r.errors);
+}
+
+void cmd_backup(kv_file *kv, const char* file){
+    int fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0){
+        printf("open backup file %s failed\r\n", file);
+        return;
+    }
+    int64_t now = get_timestamp_usec();
+    int ret = kv_backup(kv, fd);
+    int64_t total = get_timestamp_usec() - now;
+    close(fd);
+    if(ret){
+        printf("backup error=%d\r\n", ret);
+        return;
+    }
+    printf("backup %s succeed time: %ld usec\r\n", file, total);
+}
+
+void cmd_dump(kv_tree *t, const char* file){
+    int fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0){
+        printf("open dump file %s failed\r\n", file);
+        return;
+    }
+    int64_t now = get_timestamp_usec();
+    int ret = kv_tree_dump(t, fd);
+    int64_t total = get_timestamp_usec() - now;
+    close(fd);
+    if(ret){
+        printf("dump error=%d\r\n", ret);
+        return;
+    }
+    printf("dump %s succeed time: %ld usec\r\n", file, total);
+}
+
+void cmd_load(kv_tree *t, const char* file){
+    int fd = open(file, O_RDONLY);
+    if(fd < 0){
+        printf("open dump file %s failed\r\n", file);
+        return;
+    }
+    int64_t now = get_timestamp_usec();
+    int ret = kv_tree_load(t, fd);
+    int64_t total = get_timestamp_usec() - now;
+    close(fd);
+    if(ret){
+        printf("load error=%d\r\n", ret);
+        return;
+    }
+    printf("load %s succeed time: %ld usec\r\n", file, total);
+}
+
+typedef struct __batch_reader{
+    int    fd;
+    size_t pos;
+    size_t len;
+    bool   eof;
+    char   buf[64 * 1024 + 1];
+}batch_reader;
+
+typedef struct __batch_writer{
+    bool     binary;
+    uint64_t ops;
+    uint64_t errors;
+    size_t   len;
+    char     buf[KV_BATCH_OPS * 64];
+}batch_writer;
+
+// read until at least size bytes are buffered, false if input ends first
+bool batch_fill(batch_reader* r, size_t size){
+    if(r->pos > 0){
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos  = 0;
+    }
+    for(; r->len < size && !r->eof;){
+        ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - 1 - r->len);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            r->eof = true;
+            break;
+        }
+        r->len += n;
+    }
+    return r->len >= size;
+}
+
+// next line without the newline, lines longer than the buffer are cut, NULL at the end of input
+char* batch_line(batch_reader* r){
+    size_t scanned = 0;
+    char*  end;
+    for(;;){
+        end = (char*)memchr(r->buf + r->pos + scanned, '\n', r->len - r->pos - scanned);
+        if(end != NULL || r->eof || r->len - r->pos >= sizeof(r->buf) - 1){
+            break;
+        }
+        scanned = r->len - r->pos;
+        batch_fill(r, scanned + 1);
+    }
+    if(end == NULL && r->pos == r->len){
+        return NULL;
+    }
+
+    char* line = r->buf + r->pos;
+    if(end != NULL){
+        *end   = 0;
+        r->pos = end - r->buf + 1;
+    }else{
+        r->buf[r->len] = 0;
+        r->pos = r->len;
+    }
+    return line;
+}
+
+void batch_write_out(batch_writer* w){
+    fwrite(w->buf, 1, w->len, stdout);
+    fflush(stdout);
+    w->len = 0;
+}
+
+// apply the buffered commands and write their results in command order
+void batch_apply(kv_tree* t, batch_writer* w, kv_op* ops, uint32_t* num){
+    kv_tree_apply_batch(t, ops, *num);
+    for(uint32_t i=0; i<*num; ++i){
+        kv_op* op = ops + i;
+        w->errors += op->ret != CODE_SUCCEED;
+        if(w->binary){
+            uint8_t* frame = (uint8_t*)w->buf + w->len;
+            frame[0] = (uint8_t)op->ret;
+            memcpy(frame + 1, &op->key, sizeof(int64_t));
+            memcpy(frame + 9, &op->value, sizeof(int64_t));
+            w->len += KV_BATCH_FRAME;
+            continue;
+        }
+
+        const char* name = op->type == KV_OP_GET ? "get" : (op->type == KV_OP_PUT ? "put" : "del");
+        if(op->ret){
+            w->len += sprintf(w->buf + w->len, "%s key=%ld error=%d\r\n", name, op->key, op->ret);
+        }else if(op->type == KV_OP_DEL){
+            w->len += sprintf(w->buf + w->len, "del key=%ld succeed\r\n", op->key);
+        }else{
+            w->len += sprintf(w->buf + w->len, "%s key=%ld val=%ld\r\n", name, op->key, op->value);
+        }
+    }
+    w->ops += *num;
+    *num    = 0;
+    batch_write_out(w);
+}
+
+// text commands are "get <key>", "put <key> <value>" and "del <key>", empty lines and lines starting with # are skipped
+bool batch_parse_line(char* line, kv_op* op){
+    for(; *line == ' ' || *line == '\t'; ++line);
+    char* end = line + strlen(line);
+    for(; end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'); --end);
+    *end = 0;
+    if(strncmp(line, "get ", 4) == 0){
+        op->type = KV_OP_GET;
+    }else if(strncmp(line, "put ", 4) == 0){
+        op->type = KV_OP_PUT;
+    }else if(strncmp(line, "del ", 4) == 0){
+        op->type = KV_OP_DEL;
+    }else{
+        return false;
+    }
+
+    char* p = line + 4;
+    char* next;
+    errno     = 0;
+    op->key   = strtoll(p, &next, 10);
+    op->value = 0;
+    if(next == p || errno != 0){
+        return false;
+    }
+    if(op->type == KV_OP_PUT){
+        p = next;
+        op->value = strtoll(p, &next, 10);
+        if(next == p || errno != 0){
+            return false;
+        }
+    }
+    return *next == 0;
+}
+
+void cmd_batch(kv_tree *t, const char* file){
+    int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+    if(fd < 0){
+        printf("open batch file %s failed\r\n", file);
+        return;
+    }
+
+    batch_reader* r   = (batch_reader*)malloc(sizeof(batch_reader));
+    batch_writer* w   = (batch_writer*)malloc(sizeof(batch_writer));
+    kv_op*        ops = (kv_op*)malloc(sizeof(kv_op) * KV_BATCH_OPS);
+    uint32_t      num = 0;
+    r->fd     = fd;
+    r->pos    = r->len = 0;
+    r->eof    = false;
+    w->ops    = w->errors = 0;
+    w->len    = 0;
+    fflush(stdout);
+
+    uint32_t magic = KV_BATCH_MAGIC;
+    int64_t  now   = get_timestamp_usec();
+    w->binary = batch_fill(r, sizeof(magic)) && memcmp(r->buf, &magic, sizeof(magic)) == 0;
+    if(w->binary){
+        // frame is op type, key and value, the result frame is ret, key and value
+        r->pos = sizeof(magic);
+        for(; batch_fill(r, KV_BATCH_FRAME);){
+            for(; r->len - r->pos >= KV_BATCH_FRAME; r->pos += KV_BATCH_FRAME){
+                kv_op* op = ops + num;
+                op->type = (uint8_t)r->buf[r->pos];
+                memcpy(&op->key, r->buf + r->pos + 1, sizeof(int64_t));
+                memcpy(&op->value, r->buf + r->pos + 9, sizeof(int64_t));
+                if(++num == KV_BATCH_OPS){
+                    batch_apply(t, w, ops, &num);
+                }
+            }
+        }
+        if(r->len > r->pos){
+            fprintf(stderr, "batch ignore %lu trailing bytes\r\n", r->len - r->pos);
+        }
+    }else{
+        uint64_t lineno = 0;
+        for(char* line; (line = batch_line(r)) != NULL;){
+            ++lineno;
+            char* p = line;
+            for(; *p == ' ' || *p == '\t' || *p == '\r'; ++p);
+            if(*p == 0 || *p == '#'){
+                continue;
+            }
+            if(!batch_parse_line(p, ops + num)){
+                // results stay in command order
+                batch_apply(t, w, ops, &num);
+                w->len += sprintf(w->buf + w->len, "batch line %lu invalid\r\n", lineno);
+                w->errors += 1;
+                batch_write_out(w);
+                continue;
+            }
+            if(++num == KV_BATCH_OPS){
+                batch_apply(t, w, ops, &num);
+            }
+        }
+    }
+    batch_apply(t, w, ops, &num);
+    int64_t total = get_timestamp_usec() - now;
+
+    // the summary goes to stderr so stdout only carries results
+    fprintf(stderr, "batch ops: %lu errors: %lu time: %ld usec\r\n", w->ops, w->errors, total);
+    if(fd != STDIN_FILENO){
+        close(fd);
+    }
+    free(ops);
+    free(r);
+    free(w);
+}